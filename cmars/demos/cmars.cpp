@@ -9,6 +9,15 @@
 #include "chrono/physics/ChLinkTSDA.h"
 #include <../thirdparty/nlohmann/json.hpp>
 
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <ext/stdio_filebuf.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 using json = nlohmann::json;
 
 #if INCL_VSG == 1
@@ -26,6 +35,10 @@ using json = nlohmann::json;
 #include "perseverance_goto_controller.h"
 #include "perseverance_openloop_controller.h"
 #include "perseverance_logger.h"
+#include "perseverance_score.h"
+#include "perseverance_guards.h"
+#include "perseverance_sinkage.h"
+#include "terrain_backend.h"
 
 
 using namespace chrono;
@@ -44,35 +57,149 @@ double t_fix = 3.0;
 // double t_drop = 3.0;
 double offset_z = 0.1;
 
-int main(int argc, char* argv[]) {
+// Worker pipe the trial result record is written to, -1 when running standalone
+int result_fd = -1;
 
-    bool render = false;
-    json jsonData;
-    bool loaded = false;
+// Prefix of result records on a worker's output, everything else is simulation log
+const char* kResultMarker = "@@cmars-result ";
 
-    for (int i = 1; i < argc; i++) {
-        std::string arg = argv[i];
+// Running residuals of a trial go to this stream (the worker client in socket mode), prefixed with kProgressMarker
+int progress_fd = STDOUT_FILENO;
+const char* kProgressMarker = "@@cmars-progress ";
 
-        if(arg == "--render" || arg == "-r") {
-            render = true;
-        } else {
-            try{
-                jsonData = json::parse(argv[i]);
-                loaded = true;
-            } catch(const json::parse_error& e) {
-                std::cerr << "Parse error: " << e.what() << std::endl;
-            }
+// Exit status of a trial stopped by a divergence guard, its record carries "diverged" and the partial score
+const int kDivergedStatus = 3;
+
+/*
+    Soil, domain and DEM settings of a simdef for a rover starting at rover_pos
+    Shared by the trial itself and by the worker, which bakes the DEM before forking the trial
+*/
+static TerrainBackend::Settings ParseTerrainSettings(const json& jsonData, const ChVector3d& rover_pos) {
+    double t_init = jsonData["incon"]["t_init"];
+    double t_fin = jsonData["incon"]["t_fin"];
+    double spacing = jsonData["soil"]["spacing"];
+    double terr_size = jsonData["soil"]["size"];
+    std::string traj_input_dir = jsonData["downlink"]["sim_input_dir"];
+    std::string control_input_dir = jsonData["downlink"]["control_input_dir"];
+
+    HeightmapParser::SoilParameters params {
+        spacing, 
+        jsonData["soil"]["bulk_density"],
+        jsonData["soil"]["cohesion"],
+        jsonData["soil"]["friction"],
+        jsonData["soil"]["youngs_modulus"], 
+        jsonData["soil"]["poisson_ratio"]  
+    };
+    params.depth = jsonData["soil"].value("depth", params.depth);
+    params.bce_thickness = jsonData["soil"].value("bce_thickness", params.bce_thickness);
+    params.expected_sinkage = jsonData["soil"].value("expected_sinkage", params.expected_sinkage);
+    params.wheel_band = jsonData["soil"].value("wheel_band", params.wheel_band);
+
+    // FSI active box per wheel: soil.active_domain as an edge or [x, y, z], otherwise sized from the
+    // wheel, the spacing and the fastest commanded wheel rate
+    if (jsonData["soil"].contains("active_domain")) {
+        const auto& active = jsonData["soil"]["active_domain"];
+        params.active_domain = active.is_array() ? ChVector3d(active[0], active[1], active[2]) : ChVector3d(active, active, active);
+    }
+    params.max_wheel_speed = PerseveranceUtils::MaxWheelRate(control_input_dir, t_init, t_fin);
+
+    // Either a box of soil.size around the start pose or a corridor around the drive path
+    HeightmapParser::DomainParameters domain_params;
+    std::string domain = jsonData["soil"].value("domain", "box");
+    domain_params.corridor = domain == "corridor";
+    domain_params.buffer = jsonData["soil"].value("corridor_buffer", domain_params.buffer);
+
+    // The drive path shapes corridor domains and adaptive soil depth
+    if (domain_params.corridor || params.expected_sinkage > 0) {
+        domain_params.path = PerseveranceUtils::ReadTrajectory(traj_input_dir, t_init, t_fin, spacing);
+        if (domain_params.path.empty()) {
+            std::cerr << "Warning: no poses in [t_init, t_init + t_fin], using the box domain and uniform depth" << std::endl;
         }
     }
 
-    if (!loaded) {
-        std::cout << "Must provide json" << std::endl;
-        return 1;
+    TerrainBackend::Settings terrain_settings;
+    terrain_settings.size = ChVector2d(terr_size, terr_size);
+    terrain_settings.params = params;
+    for (const auto& f : jsonData["downlink"]["mod"]) {
+        terrain_settings.mod_files.push_back(f);
+    }
+    for (const auto& f : jsonData["downlink"]["ht"]) {
+        terrain_settings.ht_files.push_back(f);
     }
+    terrain_settings.rover_pos = rover_pos;
+    terrain_settings.step_size_cfd = jsonData["integrator"]["step_size_cfd"];
+    terrain_settings.dem.cache_dir = jsonData["downlink"].value("cache_dir", "");
+    terrain_settings.domain = domain_params;
+
+    // SCM soil and the terrain mesh used by the SCM and RIGID backends
+    terrain_settings.scm = TerrainBackend::ParseScmParameters(jsonData["soil"]);
+    terrain_settings.mesh.lod_block = jsonData["soil"].value("mesh_lod_block", 0);
+    terrain_settings.mesh.lod_tolerance = jsonData["soil"].value("mesh_lod_tolerance", terrain_settings.mesh.lod_tolerance);
+    terrain_settings.mesh.path = domain_params.path;
+    return terrain_settings;
+}
 
-    // Set path to Chrono data directory
-    SetChronoDataPath(std::getenv("CHRONO_DATA_PATH"));
-    
+/*
+    End a trial: send its result record to the worker, if any, then exit without unwinding the
+    simulation (tearing the FSI system down on return was exiting with -11)
+*/
+[[noreturn]] static void FinishTrial(int status, json record) {
+    std::cout.flush();
+    if (result_fd >= 0) {
+        record["status"] = status;
+        std::string line = record.dump() + "\n";
+        if (write(result_fd, line.data(), line.size()) < 0) {
+            std::cerr << "Warning: could not send the trial result" << std::endl;
+        }
+        close(result_fd);
+    }
+    exit(status);
+}
+
+/*
+    Send a progress line of the running trial, written in one call so lines of the log never split it
+*/
+static void ReportProgress(json progress) {
+    std::cout.flush();
+    progress["pid"] = getpid();
+    std::string line = kProgressMarker + progress.dump() + "\n";
+    ssize_t n = send(progress_fd, line.data(), line.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOTSOCK) {
+        n = write(progress_fd, line.data(), line.size());
+    }
+    if (n < 0) {
+        std::cerr << "Warning: could not send trial progress" << std::endl;
+    }
+}
+
+/*
+    Final residuals of a trial, in compute_score's layout (flag -1 when fewer than 3 rows were logged),
+    also written to results.score_file when given
+*/
+static json ScoreResult(const PerseveranceScore& score, const json& results) {
+    const PerseveranceScore::Residuals& r = score.GetResiduals();
+    json result = { { "flag", r.samples < 3 ? -1 : 0 } };
+    if (r.samples >= 3) {
+        result.update({ { "residual", r.residual }, { "slip_residual", r.slip_residual }, { "rot_residual", r.rot_residual },
+                        { "diff_residual", r.diff_residual }, { "combined", r.combined }, { "t_end", r.t_end } });
+    }
+
+    if (results.contains("score_file")) {
+        std::string filename = results["score_file"];
+        std::ofstream file(filename);
+        if (file.is_open()) {
+            file << result.dump() << std::endl;
+        } else {
+            std::cerr << "Warning: could not write score file " << filename << std::endl;
+        }
+    }
+    return result;
+}
+
+/*
+    Run one simdef to completion, never returns
+*/
+[[noreturn]] static void RunTrial(json jsonData, bool render) {
     double bulk_density = jsonData["soil"]["bulk_density"];
     double cohesion = jsonData["soil"]["cohesion"];
     double friction = jsonData["soil"]["friction"];
@@ -91,22 +218,10 @@ int main(int argc, char* argv[]) {
     // output_dir = output_dir +"/output.csv";
 
     double step_size = jsonData["integrator"]["step_size_mbd"];
-    double step_size_cfd = jsonData["integrator"]["step_size_cfd"];
     double terr_size = jsonData["soil"]["size"];
     std::string integrator = jsonData["integrator"]["integrator"];
 
 
-    std::vector<std::string> mod_files;
-    for (const auto& f : jsonData["downlink"]["mod"]) {
-        mod_files.push_back(f);
-    }
-    
-
-    std::vector<std::string> ht_files;
-    for (const auto& f : jsonData["downlink"]["ht"]) {
-        ht_files.push_back(f);
-    }
-    
     box = ChVector2d{terr_size,terr_size};
 
     ChSystemNSC sys;
@@ -142,31 +257,73 @@ int main(int argc, char* argv[]) {
     double rover_y = def.init_pose.GetPos().y();
     double rover_z = def.init_pose.GetPos().z();
 
-    // /*/////////////////////
-    //  *  Initialize Terrain 
-    // *//////////////////////
-    
-    double x_offset = 0.0;
-    double y_offset = 0.0;
-    double width = 0.0;
-    double height = 0.0;
+    TerrainBackend::Settings terrain_settings = ParseTerrainSettings(jsonData, ChVector3d(rover_x, rover_y, rover_z));
+    const HeightmapParser::SoilParameters& params = terrain_settings.params;
+    const HeightmapParser::DomainParameters& domain_params = terrain_settings.domain;
+    const HeightmapParser::DEMParameters& dem_params = terrain_settings.dem;
+    std::string control_input_dir = jsonData["downlink"]["control_input_dir"];
 
+    bool conform = jsonData["incon"].value("conform", false);
+    PerseveranceUtils::ConformParameters conform_params;
+    conform_params.clearance = jsonData["incon"].value("conform_clearance", conform_params.clearance);
+    t_settle = jsonData["incon"].value("t_settle", conform ? 2.0 : t_settle);
+    t_fix = jsonData["incon"].value("t_fix", conform ? 0.5 : t_fix);
 
-    HeightmapParser::SoilParameters params {
-        spacing, 
-        bulk_density,
-        cohesion,
-        friction,
-        youngs_modulus, 
-        poisson_ratio  
-    };
+    std::string terrain_type = jsonData["soil"].value("terrain", "CRM");
 
-    CRMTerrain terrain(sys,params.spacing);
+    // Settled CRM state shared by trials with the same terrain, soil, settle settings and initial pose,
+    // kept in the DEM cache directory
+    SettleCheckpoint checkpoint;
+    if (jsonData["incon"].value("settle_checkpoint", false)) {
+        if (dem_params.cache_dir.empty()) {
+            std::cerr << "Warning: settle_checkpoint needs downlink.cache_dir, settling from scratch" << std::endl;
+        } else {
+            uint64_t seed = CacheUtils::HashFile(GetChronoDataFile(filename));
+            seed = CacheUtils::HashString(integrator, seed);
+            std::vector<double> settings = { t_settle, t_fix, step_size, conform ? 1.0 : 0.0, conform_params.clearance };
+            checkpoint.Initialize(dem_params.cache_dir, seed, settings, SettleCheckpoint::CaptureBodies(def.bodies));
+            terrain_settings.checkpoint = &checkpoint;
+        }
+    }
 
-    terrain.GetFluidSystemSPH().EnableCudaErrorCheck(false);
-    
-    HeightmapParser::InitializeCRMTerrain(def,terrain,box,params,mod_files,ht_files,
-                                            ChVector3d(rover_x,rover_y,rover_z),step_size_cfd);
+    auto terrain = TerrainBackend::Create(terrain_type, sys, def, terrain_settings);
+    const HeightmapParser::HeightGrid& dem = terrain->GetBakedDEM();
+    std::cout << "Terrain backend: " << terrain->GetName() << std::endl;
+
+    // Optional export of the baked DEM for inspection
+    if (jsonData["results"].contains("dem_export")) {
+        HeightmapParser::ExportParameters export_params;
+        export_params.raw_tiles = jsonData["results"].value("dem_export_raw", false);
+        // Exported at the pyramid level matching the particle spacing, 0 keeps the full baked posting
+        double export_spacing = jsonData["results"].value("dem_export_spacing", params.spacing);
+        auto pyramid = HeightmapParser::BuildPyramid(dem, export_spacing);
+        HeightmapParser::ExportHeightmap(jsonData["results"]["dem_export"], HeightmapParser::PyramidLevel(pyramid, export_spacing), export_params);
+    }
+
+    // Optional slope/roughness rasters and per-segment terrain descriptors along the drive path
+    if (jsonData["results"].contains("terrain_descriptors")) {
+        HeightmapParser::ExportParameters export_params;
+        export_params.raw_tiles = jsonData["results"].value("dem_export_raw", false);
+        double window = jsonData["results"].value("terrain_window", 0.5);
+        double segment_length = jsonData["results"].value("terrain_segment_length", 1.0);
+
+        std::vector<ChVector2d> path = domain_params.path;
+        if (path.empty()) {
+            path = PerseveranceUtils::ReadTrajectory(traj_input_dir, t_init, t_fin, dem.spacing);
+        }
+        auto rasters = HeightmapParser::ComputeTerrainRasters(dem, window);
+        auto segments = HeightmapParser::SegmentDescriptors(rasters, path, segment_length);
+        HeightmapParser::ExportTerrainDescriptors(jsonData["results"]["terrain_descriptors"], rasters, segments, export_params);
+    }
+
+    // Put the wheels on the DEM kinematically instead of dropping the rover from z_off, so the settle
+    // phase only has to seat them in the soil. FSI bodies pick up the moved wheels on the first step.
+    // A restored settled state already has the rover seated.
+    if (checkpoint.IsRestored()) {
+        SettleCheckpoint::RestoreBodies(def.bodies, checkpoint.GetState().bodies);
+    } else if (conform) {
+        PerseveranceUtils::ConformRoverIncons(def, [&](double x, double y) { return HeightmapParser::HeightAt(dem, x, y); }, conform_params);
+    }
 
     
     std::cout << "Finished Initializing Terrain" << std::endl;
@@ -176,21 +333,21 @@ int main(int argc, char* argv[]) {
     bool visualization_bndry_bce = true;  // render boundary BCE markers
     bool visualization_rigid_bce = true;  // render wheel BCE markers
 
-    ChFsiSystemSPH& sysFSI = terrain.GetSystemFSI();
-
 #if INCL_VSG == 1
     
-    auto visFSI = chrono_types::make_shared<ChFsiVisualizationVSG>(&sysFSI);
     auto visVSG = chrono_types::make_shared<vsg3d::ChVisualSystemVSG>();
 
     if(render) {
-        visFSI->EnableFluidMarkers(visualization_sph);
-        visFSI->EnableBoundaryMarkers(visualization_bndry_bce);
-        visFSI->EnableRigidBodyMarkers(visualization_rigid_bce);
-        auto col_callback = chrono_types::make_shared<ParticleHeightColorCallback>(-35,-30);
-        visFSI->SetSPHColorCallback(col_callback, ChColormap::Type::BROWN);
+        if (CRMTerrain* crm = terrain->GetCRMTerrain()) {
+            auto visFSI = chrono_types::make_shared<ChFsiVisualizationVSG>(&crm->GetSystemFSI());
+            visFSI->EnableFluidMarkers(visualization_sph);
+            visFSI->EnableBoundaryMarkers(visualization_bndry_bce);
+            visFSI->EnableRigidBodyMarkers(visualization_rigid_bce);
+            auto col_callback = chrono_types::make_shared<ParticleHeightColorCallback>(-35,-30);
+            visFSI->SetSPHColorCallback(col_callback, ChColormap::Type::BROWN);
+            visVSG->AttachPlugin(visFSI);
+        }
         
-        visVSG->AttachPlugin(visFSI);
         visVSG->AttachSystem(&sys);
         visVSG->SetWindowTitle("M2020");
         visVSG->SetWindowSize(1280, 800);
@@ -208,15 +365,61 @@ int main(int argc, char* argv[]) {
     int render_frame = 0;
     bool started = false;
 
-    std::string control_input_dir = jsonData["downlink"]["control_input_dir"];
-
     PerseveranceOpenLoopController controller;
     controller.Initialize(t_init, &def.parser, control_input_dir);
 
+    // Per-wheel sinkage and rut depth, sampled with the log rows
+    PerseveranceSinkage sinkage;
+    sinkage.Initialize(def.wheels, def.chassis, &dem);
+
     PerseveranceLogger logger;
     logger.SetClock(t_init);
+    logger.AddChannels(PerseveranceSinkage::GetChannelNames(), [&](std::vector<double>& values) {
+        sinkage.Update(terrain->GetCRMTerrain());
+        sinkage.GetChannels(values);
+    });
+    if (CRMTerrain* crm = terrain->GetCRMTerrain()) {
+        auto& sysSPH = crm->GetFluidSystemSPH();
+        ChVector3d active_size = HeightmapParser::ActiveDomainSize(WheelMarkers::Get(sysSPH, spacing, dem_params.cache_dir), sysSPH, params);
+        logger.AddChannels({ "active_particles" }, [&, active_size](std::vector<double>& values) {
+            values.assign(1, (double)HeightmapParser::CountActiveParticles(*terrain->GetCRMTerrain(), def.wheels, active_size));
+        });
+    }
     logger.Initialize(def.chassis, &def.parser, output_dir, 1.0);
 
+    // Residuals against the telemetry, accumulated from the logged rows: streamed every progress_interval [s]
+    // of drive for pruning, and with results.score or score_file returned in the result record at the end
+    double progress_interval = jsonData["results"].value("progress_interval", 0.0);
+    double next_progress = progress_interval;
+    bool guarded = jsonData.contains("guards");
+    PerseveranceGuards::Parameters guard_params;
+    if (guarded) {
+        const json& guards = jsonData["guards"];
+        guard_params.check_interval = guards.value("check_interval", guard_params.check_interval);
+        guard_params.position_error = guards.value("position_error", guard_params.position_error);
+        guard_params.tilt = guards.value("tilt", guard_params.tilt);
+        guard_params.height = guards.value("height", guard_params.height);
+        guard_params.particle_speed = guards.value("particle_speed", guard_params.particle_speed);
+        guard_params.particle_duration = guards.value("particle_duration", guard_params.particle_duration);
+        guard_params.particle_interval = guards.value("particle_interval", guard_params.particle_interval);
+    }
+    bool scored = progress_interval > 0 || jsonData["results"].value("score", false) || jsonData["results"].contains("score_file") ||
+                  (guarded && guard_params.position_error > 0);
+    PerseveranceScore score;
+    if (scored) {
+        score.Initialize(traj_input_dir, t_init, t_fin);
+        logger.SetScore(&score);
+    }
+    PerseveranceGuards guards;
+    guards.Initialize(guard_params, def.chassis, def.bodies, &dem, scored ? &score : nullptr);
+    auto record = [&]() {
+        json record = { { "output", output_dir }, { "t_end", t_init + time - t_settle } };
+        if (scored) {
+            record["score"] = ScoreResult(score, jsonData["results"]);
+        }
+        return record;
+    };
+
     PerseveranceSlip slip_monitor;
     slip_monitor.SetClock(t_init);
     slip_monitor.Initialize(&def.parser);
@@ -228,6 +431,12 @@ int main(int argc, char* argv[]) {
 
     
     bool fixed = true;
+
+    // The drive resumes where the stored settle phase ended
+    if (checkpoint.IsRestored()) {
+        time = checkpoint.GetState().time;
+        sys.SetChTime(time);
+    }
 #if INCL_VSG == 1
     while ((render && visVSG->Run()) || !render) {
 #else 
@@ -242,7 +451,7 @@ int main(int argc, char* argv[]) {
             render_frame++;
         }
 #endif
-        terrain.Advance(step_size);
+        terrain->Advance(step_size);
 
         time += step_size;
         sim_frame++;
@@ -259,17 +468,352 @@ int main(int argc, char* argv[]) {
             def.chassis->SetAngVelLocal(ChVector3d(0,0,0));
         }
 
+        // Last settling step, save the state the drive starts from
+        if (checkpoint.IsPending() && time <= t_settle && time + step_size > t_settle) {
+            if (CRMTerrain* crm = terrain->GetCRMTerrain()) {
+                SettleCheckpoint::State state;
+                state.time = time;
+                HeightmapParser::CaptureParticles(*crm, state);
+                state.bodies = SettleCheckpoint::CaptureBodies(def.bodies);
+                checkpoint.Save(state);
+            }
+        }
+
         if(time > t_settle) {
             slip_monitor.Advance(step_size);
             logger.Advance(slip_monitor.GetLastSlip(), step_size);
+            if (progress_interval > 0 && time - t_settle >= next_progress) {
+                const PerseveranceScore::Residuals& r = score.GetResiduals();
+                ReportProgress({ { "t", time - t_settle }, { "samples", r.samples }, { "residual", r.residual },
+                                 { "slip_residual", r.slip_residual } });
+                next_progress += progress_interval;
+            }
+            if (guarded) {
+                std::string diverged = guards.Check(time - t_settle, terrain->GetCRMTerrain());
+                if (!diverged.empty()) {
+                    std::cerr << "Drive diverged at t = " << time - t_settle << " s: " << diverged << std::endl;
+                    json partial = record();
+                    partial["diverged"] = diverged;
+                    FinishTrial(kDivergedStatus, partial);
+                }
+            }
             controller.Advance({ def.chassis->GetFrameRefToAbs().GetPos(), def.chassis->GetFrameRefToAbs().GetRot() }, step_size);
         }        
         if(controller.IsComplete() || time - t_settle > t_fin) {
-            // return 0; // This was causing exit code -11, not sure why
-            exit(0);
+            // Deformed surface and ruts for comparison with post-drive products
+            if (jsonData["results"].contains("surface_export")) {
+                if (CRMTerrain* crm = terrain->GetCRMTerrain()) {
+                    HeightmapParser::ExportParameters export_params;
+                    export_params.raw_tiles = jsonData["results"].value("dem_export_raw", false);
+                    // Rasterized over the soil domain, so particles thrown clear of it do not grow the raster
+                    ChVector2d domain_size = terrain_settings.size;
+                    ChVector3d domain_center = terrain_settings.rover_pos;
+                    HeightmapParser::DomainBox(domain_params, params, domain_size, domain_center);
+                    HeightmapParser::ExportSurface(jsonData["results"]["surface_export"], crm->GetFluidSystemSPH().GetParticlePositions(),
+                                                   dem, spacing, domain_size, domain_center, export_params);
+                } else {
+                    std::cerr << "Warning: surface export needs the CRM terrain, skipped" << std::endl;
+                }
+            }
+
+            FinishTrial(0, record());
+        }
+
+    }
+
+    // Window closed before the drive finished
+    FinishTrial(0, record());
+}
+
+/*
+    Soil-independent setup done in the worker before forking a trial, so every trial inherits it:
+    the baked DEM of the trial's terrain box (products decoded and fused once per process) and the
+    stored wheel BCE markers
+    The worker itself has to stay OpenMP-free, libgomp does not survive fork once its thread pool exists,
+    so a DEM missing from downlink.cache_dir is baked into it by a throwaway child and mapped from there.
+    Without a cache_dir every trial bakes its own DEM.
+    The rover (URDF parse, ChSystem, FSI bodies) and the CRM terrain are still built in each child: they
+    depend on the trial's soil and pose, the system is mutated by the run, and the FSI side needs the
+    child's CUDA context, so none of it can be prepared here.
+*/
+static void WarmTrial(const json& jsonData) {
+    double t_init = jsonData["incon"]["t_init"];
+    double z_off = jsonData["incon"]["z_off"];
+    ChFrame<> pose = PerseveranceUtils::InitializeRoverIncons(t_init, jsonData["downlink"]["sim_input_dir"], z_off);
+
+    TerrainBackend::Settings s = ParseTerrainSettings(jsonData, pose.GetPos());
+    ChVector2d size = s.size;
+    ChVector3d center = s.rover_pos;
+    HeightmapParser::DomainBox(s.domain, s.params, size, center);
+
+    HeightmapParser::HeightGrid dem;
+    if (!s.dem.cache_dir.empty() && !HeightmapParser::FindBakedDEM(s.mod_files, s.ht_files, s.params.spacing, size, center, s.dem, dem)) {
+        std::cout.flush();
+        std::cerr.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+            int status = 0;
+            try {
+                HeightmapParser::LoadBakedDEM(s.mod_files, s.ht_files, s.params.spacing, size, center, s.dem);
+            } catch (const std::exception& e) {
+                std::cerr << "Warning: could not bake DEM: " << e.what() << std::endl;
+                status = 1;
+            }
+            std::cout.flush();
+            std::cerr.flush();
+            _exit(status);
+        }
+        if (pid > 0) {
+            waitpid(pid, nullptr, 0);
+            HeightmapParser::FindBakedDEM(s.mod_files, s.ht_files, s.params.spacing, size, center, s.dem, dem);
+        }
+    }
+    WheelMarkers::Preload(s.params.spacing, s.dem.cache_dir);
+}
+
+/*
+    Run a simdef in a child of this process and wait for it
+    Children start from this process's warm state and exit when done, so a trial that crashes or
+    leaks GPU memory never takes the worker down. CUDA contexts do not survive fork, so the parent
+    never touches the GPU and each child creates its own.
+*/
+static json ForkTrial(const json& jsonData, bool render) {
+    try {
+        WarmTrial(jsonData);
+    } catch (const std::exception& e) {
+        // The trial reports the same problem itself
+        std::cerr << "Warning: could not prepare trial: " << e.what() << std::endl;
+    }
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return { { "status", -1 }, { "error", "pipe failed" } };
+    }
+
+    std::cout.flush();
+    std::cerr.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return { { "status", -1 }, { "error", "fork failed" } };
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        result_fd = fds[1];
+        try {
+            RunTrial(jsonData, render);
+        } catch (const std::exception& e) {
+            std::cerr << "Trial failed: " << e.what() << std::endl;
+            FinishTrial(1, { { "error", e.what() } });
+        }
+    }
+
+    close(fds[1]);
+    std::string reply;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+        reply.append(buf, n);
+    }
+    close(fds[0]);
+
+    int wstatus = 0;
+    waitpid(pid, &wstatus, 0);
+
+    json record;
+    try {
+        record = json::parse(reply);
+    } catch (const json::parse_error&) {
+        record = json::object();
+    }
+    if (WIFSIGNALED(wstatus)) {
+        record["status"] = -WTERMSIG(wstatus);
+        record["error"] = std::string("terminated by signal ") + std::to_string(WTERMSIG(wstatus));
+    } else if (!record.contains("status")) {
+        record["status"] = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+    }
+    return record;
+}
+
+/*
+    Simdef of entry i of a "trials" list: the entry's telemetry, commands and initial conditions over the
+    shared soil, terrain and integrator settings, logged to the entry's trial_output_file or to
+    results.trial_output_file with _<i> before the extension
+*/
+static json TrialDefinition(const json& jsonData, size_t i) {
+    const json& entry = jsonData["trials"][i];
+    json trial = jsonData;
+    trial.erase("trials");
+    trial["downlink"]["sim_input_dir"] = entry["sim_input_dirs"];
+    trial["downlink"]["control_input_dir"] = entry["control_input_dirs"];
+    trial["incon"] = entry["incons"];
+
+    std::string output = jsonData["results"]["trial_output_file"];
+    size_t slash = output.find_last_of('/');
+    size_t dot = output.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        dot = output.size();
+    }
+    trial["results"]["trial_output_file"] = entry.value("trial_output_file", output.substr(0, dot) + "_" + std::to_string(i) + output.substr(dot));
+    return trial;
+}
+
+/*
+    Run a simdef, or every entry of its "trials" list in order, one record per trial to out
+    Trials are children of this process, so the DEM and wheel markers are prepared once for all of them.
+    With "stop_on_failure", entries after a failed (or killed) one are reported as skipped without running.
+*/
+static void RunTrials(const json& jsonData, bool render, const std::function<void(const json&)>& out) {
+    bool listed = jsonData.contains("trials") && jsonData["trials"].is_array() && !jsonData["trials"].empty();
+    size_t count = listed ? jsonData["trials"].size() : 1;
+    bool stop_on_failure = jsonData.value("stop_on_failure", false);
+    int failed = -1;
+
+    for (size_t i = 0; i < count; i++) {
+        auto start = std::chrono::steady_clock::now();
+        json record;
+        if (stop_on_failure && failed >= 0) {
+            record = { { "status", -1 }, { "skipped", true }, { "error", "trial " + std::to_string(failed) + " failed" } };
+        } else {
+            try {
+                json trial = listed ? TrialDefinition(jsonData, i) : jsonData;
+                record = ForkTrial(trial, render);
+                if (!record.contains("output")) {
+                    record["output"] = trial["results"]["trial_output_file"];
+                }
+            } catch (const std::exception& e) {
+                record = { { "status", -1 }, { "error", e.what() } };
+            }
+        }
+        if (record["status"] != 0 && failed < 0) {
+            failed = (int)i;
+        }
+        record["wall_time"] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (listed) {
+            record["trial"] = i;
+        }
+        if (jsonData.contains("id")) {
+            record["id"] = jsonData["id"];
+        }
+        out(record);
+    }
+}
+
+/*
+    Serve simdef documents from in, one result record per trial on out
+    Records are single lines prefixed with kResultMarker, since trial logs share the worker's stdout
+*/
+static void ServeTrials(std::istream& in, const std::function<void(const std::string&)>& out, bool render) {
+    while (in >> std::ws && in.peek() != EOF) {
+        json jsonData;
+        try {
+            in >> jsonData;
+        } catch (const json::parse_error& e) {
+            // The stream cannot be resynchronized after a malformed document
+            out(kResultMarker + json({ { "status", -1 }, { "error", e.what() } }).dump() + "\n");
+            return;
+        }
+
+        RunTrials(jsonData, render, [&](const json& record) { out(kResultMarker + record.dump() + "\n"); });
+    }
+}
+
+/*
+    Long-lived worker: simdefs from stdin, or from clients of a Unix socket at socket_path
+*/
+static int RunWorker(const std::string& socket_path, bool render) {
+    if (socket_path.empty()) {
+        std::cout << "Worker ready on stdin" << std::endl;
+        ServeTrials(std::cin, [](const std::string& line) { std::cout << line << std::flush; }, render);
+        return 0;
+    }
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (server < 0 || socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "Cannot create worker socket " << socket_path << std::endl;
+        return 1;
+    }
+    std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(socket_path.c_str());
+    if (bind(server, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(server, 1) != 0) {
+        std::cerr << "Cannot listen on worker socket " << socket_path << std::endl;
+        close(server);
+        return 1;
+    }
+    std::cout << "Worker listening on " << socket_path << std::endl;
+
+    // One client at a time, each may send any number of simdefs
+    while (true) {
+        int client = accept(server, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+        __gnu_cxx::stdio_filebuf<char> buf(dup(client), std::ios::in);
+        std::istream in(&buf);
+        progress_fd = client;
+        ServeTrials(in, [client](const std::string& line) {
+            if (send(client, line.data(), line.size(), MSG_NOSIGNAL) < 0) {
+                std::cerr << "Warning: worker client went away" << std::endl;
+            }
+        }, render);
+        close(client);
+    }
+}
+
+int main(int argc, char* argv[]) {
+
+    bool render = false;
+    bool worker = false;
+    std::string socket_path;
+    json jsonData;
+    bool loaded = false;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if(arg == "--render" || arg == "-r") {
+            render = true;
+        } else if (arg == "--worker") {
+            worker = true;
+            // Optional socket path, stdin otherwise
+            if (i + 1 < argc && argv[i + 1][0] != '-' && argv[i + 1][0] != '{') {
+                socket_path = argv[++i];
+            }
+        } else {
+            try{
+                jsonData = json::parse(argv[i]);
+                loaded = true;
+            } catch(const json::parse_error& e) {
+                std::cerr << "Parse error: " << e.what() << std::endl;
+            }
         }
+    }
+
+    // Set path to Chrono data directory
+    SetChronoDataPath(std::getenv("CHRONO_DATA_PATH"));
+
+    if (worker) {
+        return RunWorker(socket_path, render);
+    }
+
+    if (!loaded) {
+        std::cout << "Must provide json" << std::endl;
+        return 1;
+    }
 
+    // A "trials" list runs every entry from this process, one result record per trial on stdout
+    if (jsonData.contains("trials") && jsonData["trials"].is_array() && !jsonData["trials"].empty()) {
+        int failed = 0;
+        RunTrials(jsonData, render, [&](const json& record) {
+            failed += record["status"] != 0;
+            std::cout << kResultMarker << record.dump() << std::endl;
+        });
+        return failed > 0 ? 1 : 0;
     }
 
-    return 0;
+    RunTrial(jsonData, render);
 }
@@ -120,7 +120,7 @@ int main(int argc, char* argv[]) {
     CRMTerrain terrain(sys,params.spacing);
     
 
-    HeightmapParser::InitializeCRMTerrain(def,terrain,box,params,mod_files,ht_files,ChVector3d(rover_x,rover_y,rover_z),3e-4);
+    HeightmapParser::InitializeCRMTerrain(def,terrain,box,params,mod_files,ht_files,ChVector3d(rover_x,rover_y,rover_z),3e-4,HeightmapParser::DEMParameters(),HeightmapParser::DomainParameters());
 
     std::cout << "Finished Initializing Terrain" << std::endl;
 
@@ -27,6 +27,7 @@ using json = nlohmann::json;
 #include "perseverance_straight_drive_controller.h"
 #include "perseverance_openloop_controller.h"
 #include "perseverance_logger.h"
+#include "terrain_backend.h"
 
 
 using namespace chrono;
@@ -139,9 +140,11 @@ int main(int argc, char* argv[]) {
         poisson_ratio  // Poisson Ratio
     };
 
-    CRMTerrain terrain(sys,params.spacing);
-    
-    HeightmapParser::InitializeCRMTerrain(def, terrain, ChVector3d(6,6,0.2), params, ChVector3d(pos.x(), pos.y(), pos.z() + 0.1), step_size);
+    TerrainBackend::SCMParameters scm_params = TerrainBackend::ParseScmParameters(jsonData["soil"]);
+
+    std::string terrain_type = jsonData["soil"].value("terrain", "CRM");
+    auto terrain = TerrainBackend::CreateFlat(terrain_type, sys, def, ChVector3d(6,6,0.2), params, ChVector3d(pos.x(), pos.y(), pos.z() + 0.1), step_size, scm_params);
+    std::cout << "Terrain backend: " << terrain->GetName() << std::endl;
 
     std::cout << "Finished Initializing Terrain" << std::endl;
 
@@ -150,18 +153,17 @@ int main(int argc, char* argv[]) {
     bool visualization_bndry_bce = true;  // render boundary BCE markers
     bool visualization_rigid_bce = true;  // render wheel BCE markers
 
-    ChFsiSystemSPH& sysFSI = terrain.GetSystemFSI();
-
 #if INCL_VSG == 1
-    auto visFSI = chrono_types::make_shared<ChFsiVisualizationVSG>(&sysFSI);
-    visFSI->EnableFluidMarkers(visualization_sph);
-    visFSI->EnableBoundaryMarkers(visualization_bndry_bce);
-    visFSI->EnableRigidBodyMarkers(visualization_rigid_bce);
-    auto col_callback = chrono_types::make_shared<ParticleHeightColorCallback>(-35,-30);
-    visFSI->SetSPHColorCallback(col_callback, ChColormap::Type::BROWN);
-    
     auto visVSG = chrono_types::make_shared<vsg3d::ChVisualSystemVSG>();
-    visVSG->AttachPlugin(visFSI);
+    if (CRMTerrain* crm = terrain->GetCRMTerrain()) {
+        auto visFSI = chrono_types::make_shared<ChFsiVisualizationVSG>(&crm->GetSystemFSI());
+        visFSI->EnableFluidMarkers(visualization_sph);
+        visFSI->EnableBoundaryMarkers(visualization_bndry_bce);
+        visFSI->EnableRigidBodyMarkers(visualization_rigid_bce);
+        auto col_callback = chrono_types::make_shared<ParticleHeightColorCallback>(-35,-30);
+        visFSI->SetSPHColorCallback(col_callback, ChColormap::Type::BROWN);
+        visVSG->AttachPlugin(visFSI);
+    }
     visVSG->AttachSystem(&sys);
     visVSG->SetWindowTitle("M2020 - Slip Slope");
     visVSG->SetWindowSize(1280, 800);
@@ -196,8 +198,7 @@ int main(int argc, char* argv[]) {
     double g_z =  g * std::cos(g_angle);
 
     sys.SetGravitationalAcceleration(ChVector3d(g_x,g_y,g_z));
-    sysFSI.SetGravitationalAcceleration(ChVector3d(g_x,g_y,g_z));
-    terrain.SetGravitationalAcceleration(ChVector3d(g_x,g_y,g_z));
+    terrain->SetGravitationalAcceleration(ChVector3d(g_x,g_y,g_z));
 
     bool fixed = true;
 #if INCL_VSG == 1
@@ -214,7 +215,7 @@ int main(int argc, char* argv[]) {
             render_frame++;
         }
 #endif
-        terrain.Advance(step_size);
+        terrain->Advance(step_size);
 
         time += step_size;
         sim_frame++;
@@ -0,0 +1,146 @@
+#ifndef CACHE_UTILS_H
+#define CACHE_UTILS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+    Content hashing and memory-mapped files for the on-disk caches (no Chrono dependencies)
+*/
+class CacheUtils {
+
+public:
+
+    static constexpr uint64_t kHashSeed = 14695981039346656037ULL;
+
+    /*
+        Read-only mapping of a whole file, unmapped when the last reference goes away
+    */
+    struct MappedFile {
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+
+        ~MappedFile() {
+            if (data) {
+                munmap(const_cast<uint8_t*>(data), size);
+            }
+        }
+    };
+
+    /*
+        64-bit FNV-1a, chained through seed
+    */
+    static uint64_t HashBytes(const void* data, size_t size, uint64_t seed = kHashSeed) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        uint64_t h = seed;
+        for (size_t i = 0; i < size; i++) {
+            h ^= p[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    template <typename T>
+    static uint64_t HashValue(const T& value, uint64_t seed) {
+        return HashBytes(&value, sizeof(T), seed);
+    }
+
+    static uint64_t HashString(const std::string& str, uint64_t seed) {
+        return HashBytes(str.data(), str.size(), HashValue(str.size(), seed));
+    }
+
+    /*
+        Hash of a file's content (size included so truncated files never collide with their prefix)
+    */
+    static uint64_t HashFile(const std::string& filename, uint64_t seed = kHashSeed) {
+        auto file = MapFile(filename);
+        if (!file) {
+            throw std::runtime_error("[Cache] Error reading " + filename);
+        }
+        return HashBytes(file->data, file->size, HashValue(file->size, seed));
+    }
+
+    /*
+        Hash of a file's name, size and modification time, without reading it (name only if it cannot be stat'ed)
+    */
+    static uint64_t HashFileStamp(const std::string& filename, uint64_t seed = kHashSeed) {
+        uint64_t key = HashString(filename, seed);
+        struct stat st;
+        if (stat(filename.c_str(), &st) == 0) {
+            key = HashValue((int64_t)st.st_size, key);
+            key = HashValue((int64_t)st.st_mtim.tv_sec, key);
+            key = HashValue((int64_t)st.st_mtim.tv_nsec, key);
+        }
+        return key;
+    }
+
+    static std::string KeyHex(uint64_t key) {
+        char buf[17];
+        std::snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)key);
+        return buf;
+    }
+
+    /*
+        Map a file read-only, nullptr if it does not exist or is empty
+    */
+    static std::shared_ptr<MappedFile> MapFile(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            close(fd);
+            return nullptr;
+        }
+
+        void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            return nullptr;
+        }
+
+        auto file = std::make_shared<MappedFile>();
+        file->data = static_cast<const uint8_t*>(addr);
+        file->size = st.st_size;
+        return file;
+    }
+
+    /*
+        Write through a temporary file and rename, so concurrent trials never read a partial entry
+    */
+    static bool WriteAtomic(const std::string& filename, const std::function<void(std::ofstream&)>& writer) {
+        std::string tmp = filename + ".tmp." + std::to_string(getpid());
+        {
+            std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+            if (!out.is_open()) {
+                return false;
+            }
+            writer(out);
+            if (!out.good()) {
+                out.close();
+                std::remove(tmp.c_str());
+                return false;
+            }
+        }
+        if (std::rename(tmp.c_str(), filename.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+};
+
+#endif
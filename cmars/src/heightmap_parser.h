@@ -1,130 +1,1899 @@
 #ifndef HEIGHTMAP_PARSER_H
 #define HEIGHTMAP_PARSER_H
 
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <sstream>
+
 #include <vicar_data.h>
 #include <mod_data.h>
 #include <composite_data.h>
 #include <translated_data.h>
 #include "chrono_vehicle/terrain/CRMTerrain.h"
 #include "perseverance_utils.h"
+#include "cache_utils.h"
+#include "png_stream.h"
+#include "settle_checkpoint.h"
+#include "wheel_markers.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+using namespace chrono;
+
+#if INCL_VSG==1
+using namespace chrono::vsg3d;
+#endif
+
+using namespace chrono::vehicle;
+using namespace chrono::fsi;
+using namespace chrono::fsi::sph;
+
+class HeightmapParser {
+
+
+public:
+
+    struct SoilParameters {
+        double spacing = 0.08;
+        double density = 1200;
+        double cohesion = 4e3;
+        double friction = 0.8;
+        double youngs_modulus = 1e6;
+        double poisson_ratio = 0.3;
+        double depth = 0.3;            // [m] soil below the surface
+        double bce_thickness = 0.1;    // [m] boundary layer below the soil
+        double expected_sinkage = 0.0; // [m] sizes the soil depth per column along the path when > 0
+        double wheel_band = 1.6;       // [m] half-width of the wheel tracks around the path
+        ChVector3d active_domain = VNULL; // [m] FSI active box around each wheel, sized automatically when zero
+        double max_wheel_speed = 0.0;  // [rad/s] largest commanded wheel rate, widens the automatic active box
+    };
+
+    // Steps between neighbor searches, which are also when the FSI active domain is refreshed
+    static constexpr int kProximitySearchSteps = 4;
+
+    // Soil under a wheel is disturbed to a few times its sinkage
+    static constexpr double kSinkageDepthFactor = 5.0;
+    // Thinnest soil layer that still gives full kernel support on the floor, in particles
+    static constexpr int kMinDepthLayers = 3;
+
+    /*
+        Regular grid of DEM samples, row-major (z[iy*nx + ix]), sample (0,0) at world (x0, y0)
+    */
+    struct HeightGrid {
+        int nx = 0;
+        int ny = 0;
+        double x0 = 0.0;
+        double y0 = 0.0;
+        double spacing = 0.0;
+        double z_min = 0.0;
+        double z_max = 0.0;
+        std::shared_ptr<const float> z;       // owned buffer or a mapped cache file
+        std::shared_ptr<const uint8_t> valid; // 1 where the DEM has data, null when every sample is valid
+
+        float at(int ix, int iy) const {
+            return z.get()[(size_t)iy * nx + ix];
+        }
+
+        bool is_valid(int ix, int iy) const {
+            return !valid || valid.get()[(size_t)iy * nx + ix];
+        }
+    };
+
+    struct DEMParameters {
+        std::string cache_dir = ""; // fused heightmap cache, disabled when empty
+        double roi_margin = 1.0;    // [m] kept around the simulation box when loading products, negative loads everything
+        double bake_resolution = 0.02; // [m] posting of the fused raster every consumer samples from
+    };
+
+    /*
+        Extent of the SPH domain: a box around the start pose, or a corridor around the drive path when path is set
+    */
+    struct DomainParameters {
+        std::vector<ChVector2d> path; // planar rover path
+        bool corridor = false;        // soil only within buffer of the path, otherwise a box
+        double buffer = 1.0;          // [m] soil kept on either side of the path
+    };
+
+    struct ExportParameters {
+        bool png16 = true;      // 16-bit grayscale PNG of the whole raster, heights scaled to [z_min, z_max]
+        bool raw_tiles = false; // float32 tiles <base>_r<row>_c<col>.f32, row-major, native endianness
+        int tile_size = 1024;   // raw tile edge in samples
+        int block_rows = 64;    // rows sampled and written per pass, bounds memory to block_rows x width
+    };
+
+    struct MeshParameters {
+        int lod_block = 0;            // quadtree root size in cells (power of two), 0 for a full-resolution mesh
+        double lod_tolerance = 0.01;  // [m] largest height error a coarse quad may leave
+        double lod_keep_radius = 3.0; // [m] full resolution within this distance of the path
+        std::vector<ChVector2d> path; // rover path kept at full resolution
+    };
+
+    /*
+        Local terrain shape on the baked DEM posting, from a least-squares plane fit over a square window
+        Gradients are in the site frame (z down), so a positive dzdx means the ground drops towards +x
+    */
+    struct TerrainRasters {
+        HeightGrid dzdx;
+        HeightGrid dzdy;
+        HeightGrid slope;     // [deg] steepest slope of the fitted plane
+        HeightGrid roughness; // [m] RMS height residual about the fitted plane
+        double window = 0.0;  // [m] fit window edge
+    };
+
+    /*
+        Terrain under one stretch of the drive path, angles in degrees
+        Pitch is positive nose up and roll positive right side down, for a rover heading along the path
+    */
+    struct SegmentDescriptor {
+        double s_begin = 0.0; // [m] arc length along the path
+        double s_end = 0.0;
+        double x = 0.0;       // segment midpoint
+        double y = 0.0;
+        double heading = 0.0;
+        double pitch = 0.0;
+        double roll = 0.0;
+        double slope = 0.0;
+        double roughness = 0.0; // [m]
+    };
+
+    /*
+        Generated SPH/BCE grid points as column runs, with the offsets of their lattices
+    */
+    struct ColumnPlan {
+        ChFsiProblemSPH::ColumnRuns sph;
+        ChFsiProblemSPH::ColumnRuns bce;
+        ChVector3d sph_offset;
+        ChVector3d bce_offset;
+    };
+
+    // Column classes for corridor domains
+    static constexpr uint8_t kColumnEmpty = 0;
+    static constexpr uint8_t kColumnSoil = 1;
+    static constexpr uint8_t kColumnWall = 2;
+
+    /*
+        Axis-aligned world-space region
+    */
+    struct DEMRegion {
+        double x_min = -std::numeric_limits<double>::infinity();
+        double x_max = std::numeric_limits<double>::infinity();
+        double y_min = -std::numeric_limits<double>::infinity();
+        double y_max = std::numeric_limits<double>::infinity();
+
+        bool Intersects(const DEMRegion& other) const {
+            return x_min <= other.x_max && other.x_min <= x_max && y_min <= other.y_max && other.y_min <= y_max;
+        }
+    };
+
+    /*
+        One { transform { file ... } t0 .. t5 } entry of a composite .mod file
+    */
+    struct ModMember {
+        std::string file;                   // as written in the .mod file
+        std::vector<std::string> transform; // affine coefficients, kept verbatim
+    };
+
+    static std::shared_ptr<rsvp::ImageData> ParseHeightmap(
+                const std::string& filename,
+                bool verbose=true) {
+        std::shared_ptr<rsvp::ImageData> res =
+            rsvp::ModData::read_bare_vicarfile(filename);
+        return res;
+    }
+
+    static std::shared_ptr<rsvp::ImageData> ParseModFile(
+            const std::string& filename
+    ) 
+    {
+        std::shared_ptr<rsvp::ImageData> result = rsvp::ModData::read_modfile(filename);
+        return result;
+    }
+    
+    /*
+        Sample the DEM on an nx x ny grid in a single parallel pass, tracking the height range
+        Each composite lookup interpolates every layered image, so this is done exactly once per sample
+        Samples the composite has no data for are masked out and filled with the mean valid height
+    */
+    static HeightGrid SampleGrid(const std::shared_ptr<rsvp::ImageData>& image, double spacing, double x0, double y0, int nx, int ny) {
+        HeightGrid grid;
+        grid.nx = nx;
+        grid.ny = ny;
+        grid.x0 = x0;
+        grid.y0 = y0;
+        grid.spacing = spacing;
+
+        size_t count = (size_t)nx * ny;
+        float* z = new float[count];
+        uint8_t* valid = new uint8_t[count];
+        grid.z = std::shared_ptr<const float>(z, std::default_delete<const float[]>());
+        grid.valid = std::shared_ptr<const uint8_t>(valid, std::default_delete<const uint8_t[]>());
+
+        double z_min = 1000;
+        double z_max = -1000;
+        double z_sum = 0;
+        long n_valid = 0;
+
+        #pragma omp parallel for schedule(static) reduction(min:z_min) reduction(max:z_max) reduction(+:z_sum,n_valid)
+        for (int iy = 0; iy < ny; iy++) {
+            for (int ix = 0; ix < nx; ix++) {
+                double h = 0;
+                size_t k = (size_t)iy * nx + ix;
+                valid[k] = image->get_interpolated_pixel_double(h, x0 + ix * spacing, y0 + iy * spacing, 1);
+                z[k] = (float)h;
+                if (valid[k]) {
+                    z_min = std::min(h, z_min);
+                    z_max = std::max(h, z_max);
+                    z_sum += h;
+                    n_valid++;
+                }
+            }
+        }
+
+        if (n_valid < (long)count) {
+            float fill = n_valid > 0 ? (float)(z_sum / n_valid) : -1.0f;
+            std::cout << "Warning: " << count - n_valid << "/" << count << " DEM samples have no data, filled with " << fill << std::endl;
+            #pragma omp parallel for schedule(static)
+            for (long k = 0; k < (long)count; k++) {
+                if (!valid[k]) {
+                    z[k] = fill;
+                }
+            }
+            if (n_valid == 0) {
+                z_min = z_max = fill;
+            }
+        } else {
+            grid.valid.reset();
+        }
+
+        grid.z_min = z_min;
+        grid.z_max = z_max;
+        return grid;
+    }
+
+    /*
+        Resample the composite once onto a regular raster covering region
+    */
+    static HeightGrid Bake(const std::shared_ptr<rsvp::ImageData>& image, const DEMRegion& region, double resolution) {
+        HeightGrid layout = RegionLayout(region, resolution);
+        return SampleGrid(image, layout.spacing, layout.x0, layout.y0, layout.nx, layout.ny);
+    }
+
+    /*
+        Raster of the given posting covering region (at least 2x2 so every cell has four corners)
+    */
+    static HeightGrid RegionLayout(const DEMRegion& region, double resolution) {
+        HeightGrid grid;
+        grid.nx = std::max(2, (int)std::ceil((region.x_max - region.x_min) / resolution) + 1);
+        grid.ny = std::max(2, (int)std::ceil((region.y_max - region.y_min) / resolution) + 1);
+        grid.x0 = region.x_min;
+        grid.y0 = region.y_min;
+        grid.spacing = resolution;
+        return grid;
+    }
+
+    /*
+        Batch bilinear lookup of n world-space (x, y) points, clamped to the raster edges
+        With AVX2 eight queries are interpolated per iteration using gathers
+    */
+    static void SampleBilinear(const HeightGrid& dem, const float* x, const float* y, float* z, size_t n) {
+        const float* data = dem.z.get();
+        const int nx = dem.nx;
+        const float x0 = dem.x0;
+        const float y0 = dem.y0;
+        const float inv = 1.0 / dem.spacing;
+        const float u_max = dem.nx - 1;
+        const float v_max = dem.ny - 1;
+
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256 vx0 = _mm256_set1_ps(x0);
+        const __m256 vy0 = _mm256_set1_ps(y0);
+        const __m256 vinv = _mm256_set1_ps(inv);
+        const __m256 vzero = _mm256_setzero_ps();
+        const __m256 vu_max = _mm256_set1_ps(u_max);
+        const __m256 vv_max = _mm256_set1_ps(v_max);
+        const __m256 vu_cell = _mm256_set1_ps(u_max - 1);
+        const __m256 vv_cell = _mm256_set1_ps(v_max - 1);
+        const __m256i vnx = _mm256_set1_epi32(nx);
+
+        for (; i + 8 <= n; i += 8) {
+            __m256 u = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i), vx0), vinv);
+            __m256 v = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(y + i), vy0), vinv);
+            u = _mm256_min_ps(_mm256_max_ps(u, vzero), vu_max);
+            v = _mm256_min_ps(_mm256_max_ps(v, vzero), vv_max);
+
+            __m256 u_cell = _mm256_min_ps(_mm256_floor_ps(u), vu_cell);
+            __m256 v_cell = _mm256_min_ps(_mm256_floor_ps(v), vv_cell);
+            __m256 fu = _mm256_sub_ps(u, u_cell);
+            __m256 fv = _mm256_sub_ps(v, v_cell);
+
+            __m256i idx = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_cvttps_epi32(v_cell), vnx), _mm256_cvttps_epi32(u_cell));
+            __m256 z00 = _mm256_i32gather_ps(data, idx, 4);
+            __m256 z10 = _mm256_i32gather_ps(data + 1, idx, 4);
+            __m256 z01 = _mm256_i32gather_ps(data + nx, idx, 4);
+            __m256 z11 = _mm256_i32gather_ps(data + nx + 1, idx, 4);
+
+            __m256 a = _mm256_add_ps(z00, _mm256_mul_ps(fu, _mm256_sub_ps(z10, z00)));
+            __m256 b = _mm256_add_ps(z01, _mm256_mul_ps(fu, _mm256_sub_ps(z11, z01)));
+            _mm256_storeu_ps(z + i, _mm256_add_ps(a, _mm256_mul_ps(fv, _mm256_sub_ps(b, a))));
+        }
+#endif
+        for (; i < n; i++) {
+            float u = std::min(std::max((x[i] - x0) * inv, 0.0f), u_max);
+            float v = std::min(std::max((y[i] - y0) * inv, 0.0f), v_max);
+            float u_cell = std::min(std::floor(u), u_max - 1);
+            float v_cell = std::min(std::floor(v), v_max - 1);
+            float fu = u - u_cell;
+            float fv = v - v_cell;
+
+            const float* p = data + (size_t)v_cell * nx + (size_t)u_cell;
+            float a = p[0] + fu * (p[1] - p[0]);
+            float b = p[nx] + fu * (p[nx + 1] - p[nx]);
+            z[i] = a + fv * (b - a);
+        }
+    }
+
+    /*
+        n samples along the row y starting at x0 with step dx
+    */
+    static void SampleRow(const HeightGrid& dem, double x0, double y, double dx, int n, float* z) {
+        std::vector<float> xs(n);
+        std::vector<float> ys(n, (float)y);
+        for (int i = 0; i < n; i++) {
+            xs[i] = x0 + i * dx;
+        }
+        SampleBilinear(dem, xs.data(), ys.data(), z, n);
+    }
+
+    /*
+        Single bilinear height lookup
+    */
+    static double HeightAt(const HeightGrid& dem, double x, double y) {
+        float xs = x;
+        float ys = y;
+        float z;
+        SampleBilinear(dem, &xs, &ys, &z, 1);
+        return z;
+    }
+
+    /*
+        Resample a baked raster onto an nx x ny grid (rows in parallel), tracking the height range
+    */
+    static HeightGrid Resample(const HeightGrid& dem, double spacing, double x0, double y0, int nx, int ny) {
+        HeightGrid grid;
+        grid.nx = nx;
+        grid.ny = ny;
+        grid.x0 = x0;
+        grid.y0 = y0;
+        grid.spacing = spacing;
+
+        float* z = new float[(size_t)nx * ny];
+        grid.z = std::shared_ptr<const float>(z, std::default_delete<const float[]>());
+        double z_min = 1000;
+        double z_max = -1000;
+
+        #pragma omp parallel for schedule(static) reduction(min:z_min) reduction(max:z_max)
+        for (int iy = 0; iy < ny; iy++) {
+            float* row = z + (size_t)iy * nx;
+            SampleRow(dem, x0, y0 + iy * spacing, spacing, nx, row);
+            for (int ix = 0; ix < nx; ix++) {
+                z_min = std::min((double)row[ix], z_min);
+                z_max = std::max((double)row[ix], z_max);
+            }
+        }
+
+        grid.z_min = z_min;
+        grid.z_max = z_max;
+        return grid;
+    }
+
+    /*
+        Next mip level: each sample is the mean of a 2 x 2 block, centered on the block at twice the posting
+        Only valid samples are averaged; a block with none stays masked and takes the mean of its fill values
+    */
+    static HeightGrid Downsample(const HeightGrid& fine) {
+        HeightGrid grid;
+        grid.nx = fine.nx / 2;
+        grid.ny = fine.ny / 2;
+        grid.x0 = fine.x0 + 0.5 * fine.spacing;
+        grid.y0 = fine.y0 + 0.5 * fine.spacing;
+        grid.spacing = 2 * fine.spacing;
+
+        const size_t count = (size_t)grid.nx * grid.ny;
+        float* z = new float[count];
+        grid.z = std::shared_ptr<const float>(z, std::default_delete<const float[]>());
+        uint8_t* valid = nullptr;
+        if (fine.valid) {
+            valid = new uint8_t[count];
+            grid.valid = std::shared_ptr<const uint8_t>(valid, std::default_delete<const uint8_t[]>());
+        }
+
+        const float* src = fine.z.get();
+        const uint8_t* src_valid = fine.valid.get();
+        double z_min = 1000;
+        double z_max = -1000;
+
+        #pragma omp parallel for schedule(static) reduction(min:z_min) reduction(max:z_max)
+        for (int iy = 0; iy < grid.ny; iy++) {
+            for (int ix = 0; ix < grid.nx; ix++) {
+                size_t i00 = (size_t)(2 * iy) * fine.nx + 2 * ix;
+                size_t block[4] = { i00, i00 + 1, i00 + fine.nx, i00 + fine.nx + 1 };
+
+                float sum = 0.0f;
+                float sum_valid = 0.0f;
+                int n_valid = 0;
+                for (size_t i : block) {
+                    sum += src[i];
+                    if (!src_valid || src_valid[i]) {
+                        sum_valid += src[i];
+                        n_valid++;
+                    }
+                }
+
+                size_t out = (size_t)iy * grid.nx + ix;
+                z[out] = n_valid > 0 ? sum_valid / n_valid : 0.25f * sum;
+                if (valid) {
+                    valid[out] = n_valid > 0;
+                }
+                z_min = std::min((double)z[out], z_min);
+                z_max = std::max((double)z[out], z_max);
+            }
+        }
+
+        grid.z_min = z_min;
+        grid.z_max = z_max;
+        return grid;
+    }
+
+    /*
+        Area-averaged mip pyramid of a baked raster, level 0 is the raster itself (buffers shared)
+        Stops once the next level would be coarser than max_spacing or thinner than 2 samples
+    */
+    static std::vector<HeightGrid> BuildPyramid(const HeightGrid& dem, double max_spacing) {
+        std::vector<HeightGrid> pyramid { dem };
+        while (2 * pyramid.back().spacing <= max_spacing * (1 + 1e-6) && pyramid.back().nx >= 4 && pyramid.back().ny >= 4) {
+            pyramid.push_back(Downsample(pyramid.back()));
+        }
+        return pyramid;
+    }
+
+    /*
+        Coarsest level whose posting does not exceed spacing, so sampling at spacing neither aliases nor
+        reads more data than it needs
+    */
+    static const HeightGrid& PyramidLevel(const std::vector<HeightGrid>& pyramid, double spacing) {
+        size_t level = 0;
+        while (level + 1 < pyramid.size() && pyramid[level + 1].spacing <= spacing * (1 + 1e-6)) {
+            level++;
+        }
+        return pyramid[level];
+    }
+
+    /*
+        Column grid covering box_size centered on pos (heights not sampled)
+    */
+    static HeightGrid ColumnLayout(double spacing, const ChVector2d& box_size, const ChVector3f& pos) {
+        HeightGrid grid;
+        grid.nx = std::round(box_size.x() / spacing) + 1;
+        grid.ny = std::round(box_size.y() / spacing) + 1;
+        grid.x0 = pos.x() - box_size.x()*0.5;
+        grid.y0 = pos.y() - box_size.y()*0.5;
+        grid.spacing = spacing;
+        return grid;
+    }
+
+    /*
+        Image files referenced by a composite .mod file, resolved against the .mod directory
+    */
+    static std::vector<std::string> ParseModMembers(const std::string& filename) {
+        std::ifstream input(filename);
+        if (!input.is_open()) {
+            throw std::runtime_error("Error opening mod file " + filename);
+        }
+
+        std::string dir;
+        size_t slash = filename.find_last_of('/');
+        if (slash != std::string::npos) {
+            dir = filename.substr(0, slash + 1);
+        }
+
+        std::vector<std::string> members;
+        for (std::string token; input >> token;) {
+            if (token == "file" && input >> token) {
+                members.push_back(token[0] == '/' ? token : dir + token);
+            }
+        }
+        return members;
+    }
+
+    /*
+        Members of a flat composite .mod file, false if the file has any other structure
+    */
+    static bool ParseModComposite(const std::string& filename, std::vector<ModMember>& members) {
+        std::ifstream input(filename);
+        if (!input.is_open()) {
+            return false;
+        }
+
+        std::vector<std::string> tokens;
+        for (std::string token; input >> token;) {
+            tokens.push_back(token);
+        }
+
+        auto expect = [&](size_t i, const char* token) { return i < tokens.size() && tokens[i] == token; };
+
+        if (!expect(0, "I~") || !expect(1, "{") || !expect(2, "composite")) {
+            return false;
+        }
+
+        size_t i = 3;
+        while (expect(i, "{")) {
+            // { transform { file PATH } t0 t1 t2 t3 t4 t5 }
+            if (!expect(i + 1, "transform") || !expect(i + 2, "{") || !expect(i + 3, "file") || !expect(i + 5, "}") || !expect(i + 12, "}")) {
+                return false;
+            }
+            ModMember member;
+            member.file = tokens[i + 4];
+            member.transform.assign(tokens.begin() + i + 6, tokens.begin() + i + 12);
+            members.push_back(member);
+            i += 13;
+        }
+        return expect(i, "}") && i + 1 == tokens.size();
+    }
+
+    /*
+        Keywords of a VICAR label, first occurrence wins
+    */
+    static std::map<std::string, std::string> ReadVicarLabel(const std::string& filename) {
+        std::map<std::string, std::string> label;
+
+        std::ifstream input(filename, std::ios::binary);
+        std::string head(64, '\0');
+        if (!input.read(&head[0], head.size())) {
+            return label;
+        }
+        if (head.compare(0, 8, "LBLSIZE=") != 0) {
+            return label;
+        }
+
+        size_t lblsize = std::strtoul(head.c_str() + 8, nullptr, 10);
+        std::string text(lblsize, '\0');
+        input.seekg(0);
+        if (lblsize == 0 || !input.read(&text[0], lblsize)) {
+            return label;
+        }
+
+        size_t i = 0;
+        while (i < text.size()) {
+            while (i < text.size() && (text[i] == ' ' || text[i] == '\0')) i++;
+            size_t eq = text.find('=', i);
+            if (eq == std::string::npos) break;
+
+            std::string key = text.substr(i, eq - i);
+            size_t end = eq + 1;
+            if (end < text.size() && (text[end] == '\'' || text[end] == '(')) {
+                end = text.find(text[end] == '\'' ? '\'' : ')', end + 1);
+                end = (end == std::string::npos) ? text.size() : end + 1;
+            } else {
+                while (end < text.size() && text[end] != ' ' && text[end] != '\0') end++;
+            }
+            label.emplace(key, text.substr(eq + 1, end - eq - 1));
+            i = end;
+        }
+        return label;
+    }
+
+    /*
+        Conservative footprint of a heightmap product: max(NL, NS) samples along both axes
+        (transform = { x0, y0, a, b, c, d }: x = x0 + a*u + b*v, y = y0 + c*u + d*v)
+    */
+    static bool ProductFootprint(const std::map<std::string, std::string>& label, const double* transform, DEMRegion& region) {
+        auto nl = label.find("NL");
+        auto ns = label.find("NS");
+        if (nl == label.end() || ns == label.end()) {
+            return false;
+        }
+        double n = std::max(std::stod(nl->second), std::stod(ns->second));
+
+        region.x_min = region.y_min = std::numeric_limits<double>::infinity();
+        region.x_max = region.y_max = -std::numeric_limits<double>::infinity();
+        for (double u : { 0.0, n }) {
+            for (double v : { 0.0, n }) {
+                double x = transform[0] + transform[2] * u + transform[3] * v;
+                double y = transform[1] + transform[4] * u + transform[5] * v;
+                region.x_min = std::min(region.x_min, x);
+                region.x_max = std::max(region.x_max, x);
+                region.y_min = std::min(region.y_min, y);
+                region.y_max = std::max(region.y_max, y);
+            }
+        }
+        return true;
+    }
+
+    /*
+        Footprint of a bare VICAR heightmap from its map projection keywords
+    */
+    static bool ProductFootprint(const std::map<std::string, std::string>& label, DEMRegion& region) {
+        auto x_min = label.find("X_AXIS_MINIMUM");
+        auto y_min = label.find("Y_AXIS_MINIMUM");
+        auto scale = label.find("MAP_SCALE");
+        if (x_min == label.end() || y_min == label.end() || scale == label.end()) {
+            return false;
+        }
+        double s = std::stod(scale->second.substr(scale->second.find_first_not_of('(')));
+        double transform[6] = { std::stod(x_min->second), std::stod(y_min->second), s, 0, 0, s };
+        return ProductFootprint(label, transform, region);
+    }
+
+    /*
+        Parse a .mod file keeping only the members whose footprint meets roi, nullptr when it meets none
+        The filtered .mod goes to a private temporary directory (the DEM directory may be read-only or
+        shared), with member paths made absolute so they still resolve
+    */
+    static std::shared_ptr<rsvp::ImageData> ParseModFile(const std::string& filename, const DEMRegion& roi) {
+        std::vector<ModMember> members;
+        if (!ParseModComposite(filename, members)) {
+            return ParseModFile(filename);
+        }
+
+        std::string dir;
+        std::string base = filename;
+        size_t slash = filename.find_last_of('/');
+        if (slash != std::string::npos) {
+            dir = filename.substr(0, slash + 1);
+            base = filename.substr(slash + 1);
+        }
+
+        std::vector<ModMember> kept;
+        std::vector<std::string> kept_paths;
+        for (const auto& member : members) {
+            std::string path = member.file[0] == '/' ? member.file : dir + member.file;
+            double transform[6];
+            for (int k = 0; k < 6; k++) {
+                transform[k] = std::stod(member.transform[k]);
+            }
+
+            DEMRegion footprint;
+            if (!ProductFootprint(ReadVicarLabel(path), transform, footprint) || footprint.Intersects(roi)) {
+                kept.push_back(member);
+                kept_paths.push_back(AbsolutePath(path));
+            }
+        }
+
+        std::cout << "Windowed load of " << filename << ": " << kept.size() << "/" << members.size() << " products" << std::endl;
+
+        if (kept.empty()) {
+            return nullptr;
+        }
+        if (kept.size() == members.size()) {
+            return ParseModFile(filename);
+        }
+
+        const char* tmp_root = std::getenv("TMPDIR");
+        std::string tmp_dir = std::string(tmp_root && *tmp_root ? tmp_root : "/tmp") + "/cmars_roi_XXXXXX";
+        if (!mkdtemp(&tmp_dir[0])) {
+            std::cerr << "Warning: no temporary directory for the windowed " << filename << ", loading every product" << std::endl;
+            return ParseModFile(filename);
+        }
+        std::string windowed = tmp_dir + "/" + base;
+        bool written;
+        {
+            std::ofstream out(windowed, std::ios::trunc);
+            out << "I~" << std::endl << "{ composite" << std::endl;
+            for (size_t i = 0; i < kept.size(); i++) {
+                out << " { transform" << std::endl;
+                out << "  { file " << kept_paths[i] << " }" << std::endl;
+                out << " ";
+                for (const auto& t : kept[i].transform) {
+                    out << " " << t;
+                }
+                out << " }" << std::endl;
+            }
+            out << "}" << std::endl;
+            written = out.good();
+        }
+
+        std::shared_ptr<rsvp::ImageData> result = written ? ParseModFile(windowed) : ParseModFile(filename);
+        std::remove(windowed.c_str());
+        rmdir(tmp_dir.c_str());
+        return result;
+    }
+
+    static std::string AbsolutePath(const std::string& path) {
+        if (path.empty() || path[0] == '/') {
+            return path;
+        }
+        char cwd[4096];
+        if (!getcwd(cwd, sizeof(cwd))) {
+            return path;
+        }
+        return std::string(cwd) + "/" + path;
+    }
+
+    /*
+        Cache key: name, size and modification time of every input file (including .mod members) plus the
+        sampled region, so a hit never reads the products
+    */
+    static uint64_t GridCacheKey(const std::vector<std::string>& mod_files, const std::vector<std::string>& ht_files, const HeightGrid& layout) {
+        uint64_t key = CacheUtils::kHashSeed;
+        for (const auto& mod_file : mod_files) {
+            key = CacheUtils::HashFileStamp(mod_file, key);
+            for (const auto& member : ParseModMembers(mod_file)) {
+                key = CacheUtils::HashFileStamp(member, key);
+            }
+        }
+        for (const auto& ht_file : ht_files) {
+            key = CacheUtils::HashFileStamp(ht_file, key);
+        }
+        key = CacheUtils::HashValue(layout.nx, key);
+        key = CacheUtils::HashValue(layout.ny, key);
+        key = CacheUtils::HashValue(layout.x0, key);
+        key = CacheUtils::HashValue(layout.y0, key);
+        key = CacheUtils::HashValue(layout.spacing, key);
+        return key;
+    }
+
+    struct GridCacheHeader {
+        char magic[8];
+        uint32_t version;
+        int32_t nx;
+        int32_t ny;
+        uint32_t flags;
+        uint64_t key;
+        double x0;
+        double y0;
+        double spacing;
+        double z_min;
+        double z_max;
+    };
+
+    static constexpr char kGridCacheMagic[8] = { 'C', 'M', 'D', 'E', 'M', 0, 0, 0 };
+    static constexpr uint32_t kGridCacheVersion = 2;
+    static constexpr uint32_t kGridCacheHasMask = 1; // validity mask follows the heights
+
+    static std::string GridCachePath(const std::string& cache_dir, uint64_t key) {
+        return cache_dir + "/dem_" + CacheUtils::KeyHex(key) + ".bin";
+    }
+
+    /*
+        Map a cached grid, returns false on a miss or a stale/corrupt entry
+    */
+    static bool LoadCachedGrid(const std::string& filename, uint64_t key, HeightGrid& grid) {
+        auto file = CacheUtils::MapFile(filename);
+        if (!file || file->size < sizeof(GridCacheHeader)) {
+            return false;
+        }
+
+        GridCacheHeader header;
+        std::memcpy(&header, file->data, sizeof(header));
+        size_t count = (size_t)header.nx * header.ny;
+        bool has_mask = header.flags & kGridCacheHasMask;
+        size_t expected = sizeof(header) + count * sizeof(float) + (has_mask ? count : 0);
+        if (std::memcmp(header.magic, kGridCacheMagic, sizeof(header.magic)) != 0 || header.version != kGridCacheVersion ||
+            header.key != key || file->size != expected) {
+            return false;
+        }
+
+        grid.nx = header.nx;
+        grid.ny = header.ny;
+        grid.x0 = header.x0;
+        grid.y0 = header.y0;
+        grid.spacing = header.spacing;
+        grid.z_min = header.z_min;
+        grid.z_max = header.z_max;
+        // Aliasing pointer keeps the mapping alive for as long as the heights are used
+        grid.z = std::shared_ptr<const float>(file, reinterpret_cast<const float*>(file->data + sizeof(header)));
+        if (has_mask) {
+            grid.valid = std::shared_ptr<const uint8_t>(file, file->data + sizeof(header) + count * sizeof(float));
+        }
+        return true;
+    }
+
+    static bool StoreCachedGrid(const std::string& filename, uint64_t key, const HeightGrid& grid) {
+        GridCacheHeader header = {};
+        std::memcpy(header.magic, kGridCacheMagic, sizeof(header.magic));
+        header.version = kGridCacheVersion;
+        header.nx = grid.nx;
+        header.ny = grid.ny;
+        header.flags = grid.valid ? kGridCacheHasMask : 0;
+        header.key = key;
+        header.x0 = grid.x0;
+        header.y0 = grid.y0;
+        header.spacing = grid.spacing;
+        header.z_min = grid.z_min;
+        header.z_max = grid.z_max;
+
+        return CacheUtils::WriteAtomic(filename, [&](std::ofstream& out) {
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(grid.z.get()), (size_t)grid.nx * grid.ny * sizeof(float));
+            if (grid.valid) {
+                out.write(reinterpret_cast<const char*>(grid.valid.get()), (size_t)grid.nx * grid.ny);
+            }
+        });
+    }
+
+    /*
+        Snapshot key: the baked DEM the points are generated from plus every generation setting
+    */
+    static uint64_t SnapshotKey(const HeightGrid& baked, const HeightGrid& layout, const SoilParameters& params, const DomainParameters& domain) {
+        size_t count = (size_t)baked.nx * baked.ny;
+        uint64_t key = CacheUtils::HashValue(sizeof(ChFsiProblemSPH::ColumnRun), CacheUtils::kHashSeed);
+        key = CacheUtils::HashBytes(baked.z.get(), count * sizeof(float), key);
+        if (baked.valid) {
+            key = CacheUtils::HashBytes(baked.valid.get(), count, key);
+        }
+        key = CacheUtils::HashValue(baked.nx, key);
+        key = CacheUtils::HashValue(baked.ny, key);
+        key = CacheUtils::HashValue(baked.x0, key);
+        key = CacheUtils::HashValue(baked.y0, key);
+        key = CacheUtils::HashValue(baked.spacing, key);
+
+        key = CacheUtils::HashValue(layout.nx, key);
+        key = CacheUtils::HashValue(layout.ny, key);
+        key = CacheUtils::HashValue(layout.x0, key);
+        key = CacheUtils::HashValue(layout.y0, key);
+        key = CacheUtils::HashValue(layout.spacing, key);
+
+        key = CacheUtils::HashValue(params.depth, key);
+        key = CacheUtils::HashValue(params.bce_thickness, key);
+        key = CacheUtils::HashValue(params.expected_sinkage, key);
+        key = CacheUtils::HashValue(params.wheel_band, key);
+
+        key = CacheUtils::HashValue(domain.corridor, key);
+        key = CacheUtils::HashValue(domain.buffer, key);
+        key = CacheUtils::HashValue(domain.path.size(), key);
+        for (const auto& p : domain.path) {
+            key = CacheUtils::HashValue(p.x(), key);
+            key = CacheUtils::HashValue(p.y(), key);
+        }
+        return key;
+    }
+
+    struct SnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t key;
+        uint64_t n_sph;
+        uint64_t n_bce;
+        double sph_offset[3];
+        double bce_offset[3];
+    };
+
+    static constexpr char kSnapshotMagic[8] = { 'C', 'M', 'P', 'T', 'S', 0, 0, 0 };
+    static constexpr uint32_t kSnapshotVersion = 2;
+
+    static std::string SnapshotPath(const std::string& cache_dir, uint64_t key) {
+        return cache_dir + "/points_" + CacheUtils::KeyHex(key) + ".bin";
+    }
+
+    /*
+        Read a point-set snapshot, returns false on a miss or a stale/corrupt entry
+    */
+    static bool LoadSnapshot(const std::string& filename, uint64_t key, ColumnPlan& plan) {
+        auto file = CacheUtils::MapFile(filename);
+        if (!file || file->size < sizeof(SnapshotHeader)) {
+            return false;
+        }
+
+        SnapshotHeader header;
+        std::memcpy(&header, file->data, sizeof(header));
+        size_t run_size = sizeof(ChFsiProblemSPH::ColumnRun);
+        if (std::memcmp(header.magic, kSnapshotMagic, sizeof(header.magic)) != 0 || header.version != kSnapshotVersion ||
+            header.key != key || file->size != sizeof(header) + (header.n_sph + header.n_bce) * run_size) {
+            return false;
+        }
+
+        const uint8_t* runs = file->data + sizeof(header);
+        plan.sph.resize(header.n_sph);
+        plan.bce.resize(header.n_bce);
+        std::memcpy(plan.sph.data(), runs, header.n_sph * run_size);
+        std::memcpy(plan.bce.data(), runs + header.n_sph * run_size, header.n_bce * run_size);
+        plan.sph_offset = ChVector3d(header.sph_offset[0], header.sph_offset[1], header.sph_offset[2]);
+        plan.bce_offset = ChVector3d(header.bce_offset[0], header.bce_offset[1], header.bce_offset[2]);
+        return true;
+    }
+
+    static bool StoreSnapshot(const std::string& filename, uint64_t key, const ColumnPlan& plan) {
+        SnapshotHeader header = {};
+        std::memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+        header.version = kSnapshotVersion;
+        header.key = key;
+        header.n_sph = plan.sph.size();
+        header.n_bce = plan.bce.size();
+        header.sph_offset[0] = plan.sph_offset.x();
+        header.sph_offset[1] = plan.sph_offset.y();
+        header.sph_offset[2] = plan.sph_offset.z();
+        header.bce_offset[0] = plan.bce_offset.x();
+        header.bce_offset[1] = plan.bce_offset.y();
+        header.bce_offset[2] = plan.bce_offset.z();
+
+        return CacheUtils::WriteAtomic(filename, [&](std::ofstream& out) {
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(plan.sph.data()), plan.sph.size() * sizeof(ChFsiProblemSPH::ColumnRun));
+            out.write(reinterpret_cast<const char*>(plan.bce.data()), plan.bce.size() * sizeof(ChFsiProblemSPH::ColumnRun));
+        });
+    }
+
+    // Baked rasters kept in memory per process, cleared when full
+    static constexpr size_t kBakedMemoEntries = 8;
+
+    static std::map<uint64_t, HeightGrid>& BakedMemo() {
+        static std::map<uint64_t, HeightGrid> memo;
+        return memo;
+    }
+
+    static std::mutex& BakedMemoMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    /*
+        In-memory key: the same file stamps as GridCacheKey (.mod members included) plus the raster layout
+        and the ROI margin, which decides which products were loaded
+    */
+    static uint64_t BakedMemoKey(const std::vector<std::string>& mod_files, const std::vector<std::string>& ht_files, const HeightGrid& layout, const DEMParameters& dem) {
+        uint64_t key = CacheUtils::kHashSeed;
+        key = CacheUtils::HashValue(mod_files.size(), key);
+        for (const auto& mod_file : mod_files) {
+            key = CacheUtils::HashFileStamp(mod_file, key);
+            for (const auto& member : ParseModMembers(mod_file)) {
+                key = CacheUtils::HashFileStamp(member, key);
+            }
+        }
+        key = CacheUtils::HashValue(ht_files.size(), key);
+        for (const auto& ht_file : ht_files) {
+            key = CacheUtils::HashFileStamp(ht_file, key);
+        }
+        key = CacheUtils::HashValue(layout.nx, key);
+        key = CacheUtils::HashValue(layout.ny, key);
+        key = CacheUtils::HashValue(layout.x0, key);
+        key = CacheUtils::HashValue(layout.y0, key);
+        key = CacheUtils::HashValue(layout.spacing, key);
+        return CacheUtils::HashValue(dem.roi_margin, key);
+    }
+
+    /*
+        Parse and composite every .mod/.ht product
+    */
+    static std::shared_ptr<rsvp::ImageData> LoadComposite(const std::vector<std::string>& mod_files, const std::vector<std::string>& ht_files, const DEMRegion& roi) {
+        auto compo_img = std::make_shared<rsvp::AverageCompositeData>();
+        // auto compo_img = std::make_shared<rsvp::AlphaBlendingCompositeData>();
+
+        bool windowed = std::isfinite(roi.x_min);
+        size_t images = 0;
+
+        for(const auto& mod_file : mod_files) {
+            auto img = windowed ? HeightmapParser::ParseModFile(mod_file, roi) : HeightmapParser::ParseModFile(mod_file);
+            if (img) {
+                compo_img->add_image(img);
+                images++;
+            }
+        }
+
+        for(const auto& ht_file : ht_files) {
+            DEMRegion footprint;
+            if (windowed && ProductFootprint(ReadVicarLabel(ht_file), footprint) && !footprint.Intersects(roi)) {
+                std::cout << "Windowed load: skipping " << ht_file << std::endl;
+                continue;
+            }
+            auto img = HeightmapParser::ParseHeightmap((ht_file));
+            compo_img->add_image(img);
+            images++;
+        }
+
+        if (images == 0 && (!mod_files.empty() || !ht_files.empty())) {
+            std::ostringstream region;
+            region << "[" << roi.x_min << ", " << roi.x_max << "] x [" << roi.y_min << ", " << roi.y_max << "]";
+            throw std::runtime_error("[HeightmapParser] No DEM product covers the load region " + region.str() +
+                                     ", check the rover pose against the products");
+        }
+        return compo_img;
+    }
+
+    /*
+        Baked raster layout for the simulation box, region is the area it covers
+    */
+    static HeightGrid BakeLayout(double spacing, const ChVector2d& box_size, const ChVector3f& pos, const DEMParameters& dem, DEMRegion& region) {
+        HeightGrid columns = ColumnLayout(spacing, box_size, pos);
+
+        // One baked cell beyond the outermost columns so edge lookups stay inside the data, widened to two
+        // column spacings so the coarser pyramid levels, which shrink by up to 1.5 postings, still cover them
+        double margin = std::max(dem.bake_resolution, 2 * spacing);
+        region.x_min = columns.x0 - margin;
+        region.y_min = columns.y0 - margin;
+        region.x_max = columns.x0 + (columns.nx - 1) * columns.spacing + margin;
+        region.y_max = columns.y0 + (columns.ny - 1) * columns.spacing + margin;
+        return RegionLayout(region, dem.bake_resolution);
+    }
+
+    /*
+        Baked DEM for the simulation box from this process's memo or the disk cache, never sampling the products
+        Nothing here starts the OpenMP thread pool, so processes that fork afterwards can call it
+    */
+    static bool FindBakedDEM(const std::vector<std::string>& mod_files, const std::vector<std::string>& ht_files, double spacing, const ChVector2d& box_size, const ChVector3f& pos, const DEMParameters& dem, HeightGrid& grid) {
+        DEMRegion region;
+        HeightGrid layout = BakeLayout(spacing, box_size, pos, dem, region);
+
+        // Rasters baked earlier in this process (a worker, or the parent of forked trials) are reused as is
+        uint64_t memo_key = BakedMemoKey(mod_files, ht_files, layout, dem);
+        std::lock_guard<std::mutex> lock(BakedMemoMutex());
+        auto& memo = BakedMemo();
+        auto it = memo.find(memo_key);
+        if (it != memo.end()) {
+            std::cout << "Reused baked heightmap: " << it->second.nx << " x " << it->second.ny << std::endl;
+            grid = it->second;
+            return true;
+        }
+
+        if (dem.cache_dir.empty()) {
+            return false;
+        }
+        uint64_t key = GridCacheKey(mod_files, ht_files, layout);
+        std::string cache_file = GridCachePath(dem.cache_dir, key);
+        if (!LoadCachedGrid(cache_file, key, grid)) {
+            return false;
+        }
+        std::cout << "Loaded cached heightmap " << cache_file << std::endl;
+        if (memo.size() >= kBakedMemoEntries) {
+            memo.clear();
+        }
+        memo[memo_key] = grid;
+        return true;
+    }
+
+    /*
+        Fused DEM raster covering the simulation box, from the cache when the inputs are unchanged
+        The composite is sampled once here; everything downstream reads the baked raster
+    */
+    static HeightGrid LoadBakedDEM(const std::vector<std::string>& mod_files, const std::vector<std::string>& ht_files, double spacing, const ChVector2d& box_size, const ChVector3f& pos, const DEMParameters& dem) {
+        HeightGrid grid;
+        if (FindBakedDEM(mod_files, ht_files, spacing, box_size, pos, dem, grid)) {
+            return grid;
+        }
+
+        DEMRegion region;
+        HeightGrid layout = BakeLayout(spacing, box_size, pos, dem, region);
+
+        DEMRegion roi;
+        if (dem.roi_margin >= 0) {
+            roi.x_min = region.x_min - dem.roi_margin;
+            roi.y_min = region.y_min - dem.roi_margin;
+            roi.x_max = region.x_max + dem.roi_margin;
+            roi.y_max = region.y_max + dem.roi_margin;
+        }
+
+        auto compo_img = LoadComposite(mod_files, ht_files, roi);
+        grid = SampleGrid(compo_img, layout.spacing, layout.x0, layout.y0, layout.nx, layout.ny);
+        std::cout << "Baked DEM: " << grid.nx << " x " << grid.ny << " @ " << grid.spacing << " m" << std::endl;
+
+        if (!dem.cache_dir.empty()) {
+            uint64_t key = GridCacheKey(mod_files, ht_files, layout);
+            std::string cache_file = GridCachePath(dem.cache_dir, key);
+            if (StoreCachedGrid(cache_file, key, grid)) {
+                std::cout << "Cached heightmap " << cache_file << std::endl;
+            } else {
+                std::cerr << "Warning: could not write heightmap cache " << cache_file << std::endl;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(BakedMemoMutex());
+        auto& memo = BakedMemo();
+        if (memo.size() >= kBakedMemoEntries) {
+            memo.clear();
+        }
+        memo[BakedMemoKey(mod_files, ht_files, layout, dem)] = grid;
+        return grid;
+    }
+
+    /*
+        Column heights for the simulation box, resampled from the pyramid level of the baked DEM that
+        matches the column spacing
+    */
+    static HeightGrid ColumnGrid(const HeightGrid& dem, double spacing, const ChVector2d& box_size, const ChVector3f& pos) {
+        HeightGrid layout = ColumnLayout(spacing, box_size, pos);
+        auto pyramid = BuildPyramid(dem, spacing);
+        return Resample(PyramidLevel(pyramid, spacing), layout.spacing, layout.x0, layout.y0, layout.nx, layout.ny);
+    }
+
+    /*
+        Stream an nx x ny raster to <base>.png and/or raw tiles, block_rows rows at a time
+        sample_row fills one row (iy, image row iy is world y0 + iy * spacing) and is called in parallel
+        A <base>.json sidecar records the georeferencing and the 16-bit height scale
+    */
+    static void ExportHeightmap(const std::string& base, int nx, int ny, double x0, double y0, double spacing, double z_min, double z_max,
+                                const std::function<void(int, float*)>& sample_row, const ExportParameters& opts) {
+        if (nx <= 0 || ny <= 0) {
+            throw std::runtime_error("[HeightmapParser] Empty heightmap export " + base);
+        }
+
+        int block_rows = std::max(1, opts.block_rows);
+        int tile = std::max(1, opts.tile_size);
+        int tiles_x = (nx + tile - 1) / tile;
+        double range = z_max > z_min ? z_max - z_min : 1.0;
+
+        std::unique_ptr<PngStream16> png;
+        if (opts.png16) {
+            png = std::make_unique<PngStream16>(base + ".png", nx, ny);
+        }
+
+        std::vector<float> heights((size_t)block_rows * nx);
+        std::vector<uint16_t> samples(opts.png16 ? (size_t)block_rows * nx : 0);
+
+        for (int iy0 = 0; iy0 < ny; iy0 += block_rows) {
+            int rows = std::min(block_rows, ny - iy0);
+
+            #pragma omp parallel for schedule(static)
+            for (int r = 0; r < rows; r++) {
+                float* row = heights.data() + (size_t)r * nx;
+                sample_row(iy0 + r, row);
+                if (png) {
+                    uint16_t* out = samples.data() + (size_t)r * nx;
+                    for (int ix = 0; ix < nx; ix++) {
+                        double t = std::clamp((row[ix] - z_min) / range, 0.0, 1.0);
+                        out[ix] = std::lround(t * 65535.0);
+                    }
+                }
+            }
+
+            if (png) {
+                png->WriteRows(samples.data(), rows);
+            }
+
+            if (opts.raw_tiles) {
+                // A block never straddles two tile rows when block_rows divides tile_size, so split at tile edges
+                for (int r0 = 0; r0 < rows;) {
+                    int iy = iy0 + r0;
+                    int ty = iy / tile;
+                    int r1 = std::min(rows, (ty + 1) * tile - iy0);
+                    for (int tx = 0; tx < tiles_x; tx++) {
+                        int ix0 = tx * tile;
+                        int width = std::min(tile, nx - ix0);
+                        std::string name = base + "_r" + std::to_string(ty) + "_c" + std::to_string(tx) + ".f32";
+                        std::ofstream out(name, std::ios::binary | (iy % tile == 0 ? std::ios::trunc : std::ios::app));
+                        if (!out.is_open()) {
+                            throw std::runtime_error("[HeightmapParser] Error writing " + name);
+                        }
+                        for (int r = r0; r < r1; r++) {
+                            out.write(reinterpret_cast<const char*>(heights.data() + (size_t)r * nx + ix0), width * sizeof(float));
+                        }
+                    }
+                    r0 = r1;
+                }
+            }
+        }
+
+        if (png) {
+            png->Close();
+        }
+
+        std::ofstream meta(base + ".json");
+        meta << "{" << std::endl
+             << "    \"nx\": " << nx << "," << std::endl
+             << "    \"ny\": " << ny << "," << std::endl
+             << "    \"x0\": " << std::setprecision(17) << x0 << "," << std::endl
+             << "    \"y0\": " << y0 << "," << std::endl
+             << "    \"spacing\": " << spacing << "," << std::endl
+             << "    \"z_min\": " << z_min << "," << std::endl
+             << "    \"z_max\": " << z_max << "," << std::endl
+             << "    \"png16\": " << (opts.png16 ? "true" : "false") << "," << std::endl
+             << "    \"raw_tile_size\": " << (opts.raw_tiles ? tile : 0) << std::endl
+             << "}" << std::endl;
+
+        std::cout << "Exported " << nx << " x " << ny << " heightmap to " << base << std::endl;
+    }
+
+    /*
+        Export a baked DEM at its own posting
+    */
+    static void ExportHeightmap(const std::string& base, const HeightGrid& dem, const ExportParameters& opts) {
+        ExportHeightmap(base, dem.nx, dem.ny, dem.x0, dem.y0, dem.spacing, dem.z_min, dem.z_max,
+                        [&](int iy, float* row) {
+                            std::memcpy(row, dem.z.get() + (size_t)iy * dem.nx, dem.nx * sizeof(float));
+                        }, opts);
+    }
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "../thirdparty/stb_image_write.h"
+    /*
+        Export a composite over region straight from the products, for sites too large to bake in memory
+        The height range comes from a first streaming pass
+    */
+    static void ExportHeightmap(const std::string& base, const std::shared_ptr<rsvp::ImageData>& image, const DEMRegion& region, double spacing, const ExportParameters& opts) {
+        HeightGrid layout = RegionLayout(region, spacing);
+        int nx = layout.nx;
+
+        auto sample_row = [&](int iy, float* row) {
+            for (int ix = 0; ix < nx; ix++) {
+                double h = 0;
+                bool valid = image->get_interpolated_pixel_double(h, layout.x0 + ix * spacing, layout.y0 + iy * spacing, 1);
+                row[ix] = valid ? (float)h : std::numeric_limits<float>::quiet_NaN();
+            }
+        };
+
+        double z_min = std::numeric_limits<double>::infinity();
+        double z_max = -std::numeric_limits<double>::infinity();
+        #pragma omp parallel reduction(min:z_min) reduction(max:z_max)
+        {
+            std::vector<float> row(nx);
+            #pragma omp for schedule(static)
+            for (int iy = 0; iy < layout.ny; iy++) {
+                sample_row(iy, row.data());
+                for (float h : row) {
+                    if (std::isfinite(h)) {
+                        z_min = std::min((double)h, z_min);
+                        z_max = std::max((double)h, z_max);
+                    }
+                }
+            }
+        }
+        if (!std::isfinite(z_min)) {
+            throw std::runtime_error("[HeightmapParser] No DEM data in export region for " + base);
+        }
 
-using namespace chrono;
+        // No-data samples stay NaN in raw tiles and clamp to 0 in the PNG
+        ExportHeightmap(base, layout.nx, layout.ny, layout.x0, layout.y0, spacing, z_min, z_max, sample_row, opts);
+    }
 
-#if INCL_VSG==1
-using namespace chrono::vsg3d;
-#endif
+    /*
+        Gradient, slope and roughness rasters of dem, fitting a plane over a window x window box per sample
+        Box sums are separable: a row pass, then a column pass over whole rows, both contiguous and vectorized
+        Samples near the edges replicate the border
+    */
+    static TerrainRasters ComputeTerrainRasters(const HeightGrid& dem, double window) {
+        const int nx = dem.nx;
+        const int ny = dem.ny;
+        const int r = std::max(1, (int)std::lround(0.5 * window / dem.spacing));
+        const double n = (double)(2 * r + 1) * (2 * r + 1);
+        const double saa = (2 * r + 1) * (r * (r + 1) * (2 * r + 1) / 3.0); // sum of a^2 over the box
+        const float* z = dem.z.get();
+
+        // Row pass: sum z, a * z and z^2 over [ix - r, ix + r]
+        size_t count = (size_t)nx * ny;
+        std::vector<double> s0(count), s1(count), s2(count);
+
+        #pragma omp parallel
+        {
+            std::vector<double> pad(nx + 2 * r);
+            #pragma omp for schedule(static)
+            for (int iy = 0; iy < ny; iy++) {
+                const float* row = z + (size_t)iy * nx;
+                for (int i = 0; i < nx + 2 * r; i++) {
+                    pad[i] = row[std::clamp(i - r, 0, nx - 1)];
+                }
 
-using namespace chrono::vehicle;
-using namespace chrono::fsi;
-using namespace chrono::fsi::sph;
+                double* r0 = s0.data() + (size_t)iy * nx;
+                double* r1 = s1.data() + (size_t)iy * nx;
+                double* r2 = s2.data() + (size_t)iy * nx;
+                std::fill(r0, r0 + nx, 0.0);
+                std::fill(r1, r1 + nx, 0.0);
+                std::fill(r2, r2 + nx, 0.0);
+                for (int a = -r; a <= r; a++) {
+                    const double* src = pad.data() + r + a;
+                    #pragma omp simd
+                    for (int ix = 0; ix < nx; ix++) {
+                        r0[ix] += src[ix];
+                        r1[ix] += a * src[ix];
+                        r2[ix] += src[ix] * src[ix];
+                    }
+                }
+            }
+        }
 
-class HeightmapParser {
+        float* gx = new float[count];
+        float* gy = new float[count];
+        float* slope = new float[count];
+        float* rough = new float[count];
+
+        double gx_min = 0, gx_max = 0, gy_min = 0, gy_max = 0, slope_max = 0, rough_max = 0;
+
+        // Column pass: sum the row sums over [iy - r, iy + r], then solve the plane per sample
+        #pragma omp parallel reduction(min:gx_min, gy_min) reduction(max:gx_max, gy_max, slope_max, rough_max)
+        {
+            std::vector<double> t0(nx), tb(nx), t1(nx), t2(nx);
+            #pragma omp for schedule(static)
+            for (int iy = 0; iy < ny; iy++) {
+                std::fill(t0.begin(), t0.end(), 0.0);
+                std::fill(tb.begin(), tb.end(), 0.0);
+                std::fill(t1.begin(), t1.end(), 0.0);
+                std::fill(t2.begin(), t2.end(), 0.0);
+                for (int b = -r; b <= r; b++) {
+                    size_t off = (size_t)std::clamp(iy + b, 0, ny - 1) * nx;
+                    const double* r0 = s0.data() + off;
+                    const double* r1 = s1.data() + off;
+                    const double* r2 = s2.data() + off;
+                    #pragma omp simd
+                    for (int ix = 0; ix < nx; ix++) {
+                        t0[ix] += r0[ix];
+                        tb[ix] += b * r0[ix];
+                        t1[ix] += r1[ix];
+                        t2[ix] += r2[ix];
+                    }
+                }
 
+                size_t off = (size_t)iy * nx;
+                for (int ix = 0; ix < nx; ix++) {
+                    double mean = t0[ix] / n;
+                    double dx = t1[ix] / saa;
+                    double dy = tb[ix] / saa;
+                    double residual = t2[ix] / n - mean * mean - (dx * t1[ix] + dy * tb[ix]) / n;
+
+                    gx[off + ix] = dx / dem.spacing;
+                    gy[off + ix] = dy / dem.spacing;
+                    slope[off + ix] = std::atan(std::sqrt(gx[off + ix] * gx[off + ix] + gy[off + ix] * gy[off + ix])) * 180.0 / CH_PI;
+                    rough[off + ix] = std::sqrt(std::max(residual, 0.0));
+
+                    gx_min = std::min(gx_min, (double)gx[off + ix]);
+                    gx_max = std::max(gx_max, (double)gx[off + ix]);
+                    gy_min = std::min(gy_min, (double)gy[off + ix]);
+                    gy_max = std::max(gy_max, (double)gy[off + ix]);
+                    slope_max = std::max(slope_max, (double)slope[off + ix]);
+                    rough_max = std::max(rough_max, (double)rough[off + ix]);
+                }
+            }
+        }
 
-public:
+        auto raster = [&](float* data, double lo, double hi) {
+            HeightGrid grid;
+            grid.nx = nx;
+            grid.ny = ny;
+            grid.x0 = dem.x0;
+            grid.y0 = dem.y0;
+            grid.spacing = dem.spacing;
+            grid.z_min = lo;
+            grid.z_max = hi;
+            grid.z = std::shared_ptr<const float>(data, std::default_delete<const float[]>());
+            grid.valid = dem.valid;
+            return grid;
+        };
+
+        TerrainRasters rasters;
+        rasters.dzdx = raster(gx, gx_min, gx_max);
+        rasters.dzdy = raster(gy, gy_min, gy_max);
+        rasters.slope = raster(slope, 0.0, slope_max);
+        rasters.roughness = raster(rough, 0.0, rough_max);
+        rasters.window = (2 * r + 1) * dem.spacing;
+        return rasters;
+    }
 
-    struct SoilParameters {
-        double spacing = 0.08;
-        double density = 1200;
-        double cohesion = 4e3;
-        double friction = 0.8;
-        double youngs_modulus = 1e6;
-        double poisson_ratio = 0.3;
-    };
+    /*
+        Mean terrain descriptors over consecutive segment_length stretches of path
+        The path is walked at the raster posting; samples outside the rasters are skipped, as are segments without any
+    */
+    static std::vector<SegmentDescriptor> SegmentDescriptors(const TerrainRasters& rasters, const std::vector<ChVector2d>& path, double segment_length) {
+        std::vector<SegmentDescriptor> segments;
+        if (path.size() < 2 || segment_length <= 0) {
+            return segments;
+        }
 
-    static std::shared_ptr<rsvp::ImageData> ParseHeightmap(
-                const std::string& filename,
-                bool verbose=true) {
-        std::shared_ptr<rsvp::ImageData> res =
-            rsvp::ModData::read_bare_vicarfile(filename);
-        return res;
+        const HeightGrid& grid = rasters.slope;
+        double x_max = grid.x0 + (grid.nx - 1) * grid.spacing;
+        double y_max = grid.y0 + (grid.ny - 1) * grid.spacing;
+        double step = grid.spacing;
+
+        // Samples of the current segment
+        std::vector<float> xs, ys, hx, hy;
+        double s = 0.0;
+        double s_begin = 0.0;
+
+        auto close_segment = [&](double s_end) {
+            if (!xs.empty()) {
+                size_t count = xs.size();
+                std::vector<float> dzdx(count), dzdy(count), slope(count), rough(count);
+                SampleBilinear(rasters.dzdx, xs.data(), ys.data(), dzdx.data(), count);
+                SampleBilinear(rasters.dzdy, xs.data(), ys.data(), dzdy.data(), count);
+                SampleBilinear(rasters.slope, xs.data(), ys.data(), slope.data(), count);
+                SampleBilinear(rasters.roughness, xs.data(), ys.data(), rough.data(), count);
+
+                SegmentDescriptor seg;
+                seg.s_begin = s_begin;
+                seg.s_end = s_end;
+                double sum_hx = 0.0;
+                double sum_hy = 0.0;
+                for (size_t i = 0; i < count; i++) {
+                    // z down: the ground rises along the heading when dz/ds < 0, and drops to the right when dz/dr > 0
+                    double along = dzdx[i] * hx[i] + dzdy[i] * hy[i];
+                    double right = -dzdx[i] * hy[i] + dzdy[i] * hx[i];
+                    seg.pitch += std::atan(-along);
+                    seg.roll += std::atan(right);
+                    seg.slope += slope[i];
+                    seg.roughness += rough[i];
+                    seg.x += xs[i];
+                    seg.y += ys[i];
+                    sum_hx += hx[i];
+                    sum_hy += hy[i];
+                }
+                seg.pitch *= 180.0 / CH_PI / count;
+                seg.roll *= 180.0 / CH_PI / count;
+                seg.slope /= count;
+                seg.roughness /= count;
+                seg.x /= count;
+                seg.y /= count;
+                seg.heading = std::atan2(sum_hy, sum_hx) * 180.0 / CH_PI;
+                segments.push_back(seg);
+            }
+            xs.clear();
+            ys.clear();
+            hx.clear();
+            hy.clear();
+            s_begin = s_end;
+        };
+
+        for (size_t k = 0; k + 1 < path.size(); k++) {
+            ChVector2d d = path[k + 1] - path[k];
+            double length = d.Length();
+            if (length <= 0) {
+                continue;
+            }
+            d = d * (1.0 / length);
+
+            for (double t = 0.0; t < length; t += step) {
+                while (s + t - s_begin >= segment_length) {
+                    close_segment(s_begin + segment_length);
+                }
+                ChVector2d p = path[k] + d * t;
+                if (p.x() < grid.x0 || p.x() > x_max || p.y() < grid.y0 || p.y() > y_max) {
+                    continue;
+                }
+                xs.push_back(p.x());
+                ys.push_back(p.y());
+                hx.push_back(d.x());
+                hy.push_back(d.y());
+            }
+            s += length;
+        }
+        close_segment(s);
+        return segments;
     }
 
-    static std::shared_ptr<rsvp::ImageData> ParseModFile(
-            const std::string& filename
-    ) 
-    {
-        std::shared_ptr<rsvp::ImageData> result = rsvp::ModData::read_modfile(filename);
-        return result;
+    /*
+        Export the rasters (<base>_dzdx, _dzdy, _slope, _roughness) and the segment table <base>_segments.csv
+    */
+    static void ExportTerrainDescriptors(const std::string& base, const TerrainRasters& rasters, const std::vector<SegmentDescriptor>& segments, const ExportParameters& opts) {
+        ExportHeightmap(base + "_dzdx", rasters.dzdx, opts);
+        ExportHeightmap(base + "_dzdy", rasters.dzdy, opts);
+        ExportHeightmap(base + "_slope", rasters.slope, opts);
+        ExportHeightmap(base + "_roughness", rasters.roughness, opts);
+
+        std::string filename = base + "_segments.csv";
+        std::ofstream out(filename);
+        if (!out.is_open()) {
+            throw std::runtime_error("[HeightmapParser] Error writing " + filename);
+        }
+        out << "SEGMENT,S_BEGIN,S_END,X,Y,HEADING,PITCH,ROLL,SLOPE,ROUGHNESS" << std::endl;
+        out << std::setprecision(9);
+        for (size_t i = 0; i < segments.size(); i++) {
+            const auto& seg = segments[i];
+            out << i << "," << seg.s_begin << "," << seg.s_end << "," << seg.x << "," << seg.y << "," << seg.heading << ","
+                << seg.pitch << "," << seg.roll << "," << seg.slope << "," << seg.roughness << std::endl;
+        }
+        std::cout << "Exported " << segments.size() << " terrain segments to " << filename << std::endl;
     }
-    
-    static void 
-        as16BitPNG(std::string filename, const std::shared_ptr<rsvp::ImageData>& heightmap, float spacing, double width, double height, double x_offset, double y_offset) {
 
-        int pixel_width = width/spacing;
-        int pixel_height = height/spacing;
-        
-        float heights[pixel_width][pixel_height];
-        uint8_t image[pixel_width][pixel_height];
-       
-        float max = -1000;
-        float min = 1000;
+    /*
+        Deformed soil surface: the highest SPH particle (smallest z, site frame is z down) per cell
+        The grid covers the size box around center (the terrain domain) on the DEM lattice, one cell every
+        ceil(spacing / dem.spacing) DEM posts, so each cell sits on a DEM sample. Particles outside the box are
+        dropped; cells holding no particle keep the DEM height and are flagged invalid. Particles are binned in
+        parallel with a per-thread min reduction, bounded by the box rather than by wherever particles splashed.
+    */
+    static HeightGrid ParticleSurface(const std::vector<ChVector3d>& positions, const HeightGrid& dem, double spacing, const ChVector2d& size, const ChVector3d& center) {
+        if (positions.empty()) {
+            throw std::runtime_error("[HeightmapParser] No particles for the surface raster");
+        }
+
+        int step = std::max(1, (int)std::ceil(spacing / dem.spacing - 1e-6));
+        int ix_lo = std::max(0, (int)std::floor((center.x() - 0.5 * size.x() - dem.x0) / dem.spacing));
+        int iy_lo = std::max(0, (int)std::floor((center.y() - 0.5 * size.y() - dem.y0) / dem.spacing));
+        int ix_hi = std::min(dem.nx - 1, (int)std::ceil((center.x() + 0.5 * size.x() - dem.x0) / dem.spacing));
+        int iy_hi = std::min(dem.ny - 1, (int)std::ceil((center.y() + 0.5 * size.y() - dem.y0) / dem.spacing));
+        if (ix_hi < ix_lo || iy_hi < iy_lo) {
+            throw std::runtime_error("[HeightmapParser] Terrain domain lies outside the DEM, no surface raster");
+        }
 
-        for (int j = -pixel_height*0.5f; j < pixel_height*0.5f; ++j) {
-            for (int i = -pixel_width*0.5f; i < pixel_width*0.5f; ++i) {
-                float x = i * spacing + x_offset;
-                float y = j * spacing + y_offset;
-                double z = 0;
-                heightmap->get_interpolated_pixel_double(z, x, y, 1);
-                heights[i][j] = z;
+        HeightGrid grid;
+        grid.nx = (ix_hi - ix_lo) / step + 1;
+        grid.ny = (iy_hi - iy_lo) / step + 1;
+        grid.x0 = dem.x0 + ix_lo * dem.spacing;
+        grid.y0 = dem.y0 + iy_lo * dem.spacing;
+        grid.spacing = step * dem.spacing;
+
+        const double x_lo = grid.x0;
+        const double y_lo = grid.y0;
+        const double cell = grid.spacing;
+
+        size_t count = (size_t)grid.nx * grid.ny;
+        float* top = new float[count];
+        std::fill(top, top + count, std::numeric_limits<float>::infinity());
+
+        const int nx = grid.nx;
+        const int ny = grid.ny;
+        #pragma omp parallel for schedule(static) reduction(min:top[:count])
+        for (size_t i = 0; i < positions.size(); i++) {
+            int ix = std::lround((positions[i].x() - x_lo) / cell);
+            int iy = std::lround((positions[i].y() - y_lo) / cell);
+            if (ix >= 0 && ix < nx && iy >= 0 && iy < ny) {
+                size_t c = (size_t)iy * nx + ix;
+                top[c] = std::min(top[c], (float)positions[i].z());
             }
         }
-        for(int i = 0; i <  pixel_width; i++) {
-            for(int j = 0; j < pixel_height; j++) {
-                max = std::fmax(heights[i][j],max);
-                min = std::fmin(heights[i][j],min);
+
+        uint8_t* valid = new uint8_t[count];
+        size_t empty = 0;
+        double z_min = std::numeric_limits<double>::infinity();
+        double z_max = -std::numeric_limits<double>::infinity();
+
+        #pragma omp parallel reduction(+:empty) reduction(min:z_min) reduction(max:z_max)
+        {
+            std::vector<float> row(nx);
+            #pragma omp for schedule(static)
+            for (int iy = 0; iy < ny; iy++) {
+                SampleRow(dem, x_lo, y_lo + iy * cell, cell, nx, row.data());
+                for (int ix = 0; ix < nx; ix++) {
+                    size_t c = (size_t)iy * nx + ix;
+                    valid[c] = std::isfinite(top[c]);
+                    if (!valid[c]) {
+                        top[c] = row[ix];
+                        empty++;
+                    }
+                    z_min = std::min(z_min, (double)top[c]);
+                    z_max = std::max(z_max, (double)top[c]);
+                }
             }
         }
 
-        for(int i = 0; i < pixel_width; i++) {
-            for(int j = 0; j < pixel_height; j++) {
-                uint8_t h = (heights[i][j]-min)/(max-min);
-                image[i][j] = h;
+        grid.z = std::shared_ptr<const float>(top, std::default_delete<const float[]>());
+        if (empty > 0) {
+            grid.valid = std::shared_ptr<const uint8_t>(valid, std::default_delete<const uint8_t[]>());
+        } else {
+            delete[] valid;
+        }
+        grid.z_min = z_min;
+        grid.z_max = z_max;
+        return grid;
+    }
+
+    /*
+        surface - dem per surface sample, positive where the soil was pushed down (ruts), negative where it piled up
+        Undisturbed soil reads within half a particle spacing of zero, the lattice rounding of the initial fill
+    */
+    static HeightGrid SurfaceDifference(const HeightGrid& surface, const HeightGrid& dem) {
+        HeightGrid diff = surface;
+        float* d = new float[(size_t)surface.nx * surface.ny];
+        double d_min = 0.0;
+        double d_max = 0.0;
+
+        #pragma omp parallel reduction(min:d_min) reduction(max:d_max)
+        {
+            std::vector<float> row(surface.nx);
+            #pragma omp for schedule(static)
+            for (int iy = 0; iy < surface.ny; iy++) {
+                SampleRow(dem, surface.x0, surface.y0 + iy * surface.spacing, surface.spacing, surface.nx, row.data());
+                for (int ix = 0; ix < surface.nx; ix++) {
+                    size_t c = (size_t)iy * surface.nx + ix;
+                    d[c] = surface.is_valid(ix, iy) ? surface.z.get()[c] - row[ix] : 0.0f;
+                    d_min = std::min(d_min, (double)d[c]);
+                    d_max = std::max(d_max, (double)d[c]);
+                }
             }
         }
 
-        stbi_write_png(filename.c_str(), pixel_width, pixel_height, 1, image, pixel_width);
+        diff.z = std::shared_ptr<const float>(d, std::default_delete<const float[]>());
+        diff.z_min = d_min;
+        diff.z_max = d_max;
+        return diff;
+    }
+
+    /*
+        Export the particle surface over the size box around center to <base> and its difference to the DEM
+        to <base>_diff, as heightmap exports
+    */
+    static void ExportSurface(const std::string& base, const std::vector<ChVector3d>& positions, const HeightGrid& dem, double spacing,
+                              const ChVector2d& size, const ChVector3d& center, const ExportParameters& opts) {
+        auto pyramid = BuildPyramid(dem, spacing);
+        const HeightGrid& level = PyramidLevel(pyramid, spacing);
+        HeightGrid surface = ParticleSurface(positions, level, spacing, size, center);
+        ExportHeightmap(base, surface, opts);
+        ExportHeightmap(base + "_diff", SurfaceDifference(surface, level), opts);
+    }
+
+    /*
+        16-bit PNG of a width x height window of the baked DEM centered on (x_offset, y_offset)
+    */
+    static void 
+        as16BitPNG(std::string filename, const HeightGrid& dem, float spacing, double width, double height, double x_offset, double y_offset) {
+
+        int pixel_width = width/spacing;
+        int pixel_height = height/spacing;
+
+        double x0 = x_offset - (pixel_width / 2) * spacing;
+        double y0 = y_offset - (pixel_height / 2) * spacing;
+
+        std::string base = filename.size() > 4 && filename.substr(filename.size() - 4) == ".png" ? filename.substr(0, filename.size() - 4) : filename;
+
+        auto pyramid = BuildPyramid(dem, spacing);
+        const HeightGrid& level = PyramidLevel(pyramid, spacing);
+
+        ExportParameters opts;
+        ExportHeightmap(base, pixel_width, pixel_height, x0, y0, spacing, dem.z_min, dem.z_max,
+                        [&](int iy, float* row) { SampleRow(level, x0, y0 + iy * spacing, spacing, pixel_width, row); }, opts);
     }
 
 
 
+    /*
+        Mesh of a width x height window of the baked DEM centered on (x_offset, y_offset), one vertex per spacing
+    */
     static std::shared_ptr<ChTriangleMeshConnected> 
-        asChronoMesh(const std::shared_ptr<rsvp::ImageData>& heightmap, float spacing, double width, double height, double x_offset, double y_offset) {
+        asChronoMesh(const HeightGrid& dem, float spacing, double width, double height, double x_offset, double y_offset) {
 
-        auto mesh = chrono_types::make_shared<ChTriangleMeshConnected>();
-        
         int pixel_width = width/spacing;
         int pixel_height = height/spacing;
-        
-        std::vector<ChVector3d> vertices;
-        for (int j = -pixel_height*0.5f; j < pixel_height*0.5f; ++j) {
-            for (int i = -pixel_width*0.5f; i < pixel_width*0.5f; ++i) {
-                float x = i * spacing + x_offset;
-                float y = j * spacing + y_offset;
-                double z = 0;
-                heightmap->get_interpolated_pixel_double(z, x, y, 1);
-                vertices.push_back({x,y,z});
+
+        double x0 = x_offset - (pixel_width / 2) * spacing;
+        double y0 = y_offset - (pixel_height / 2) * spacing;
+
+        auto pyramid = BuildPyramid(dem, spacing);
+        return asChronoMesh(Resample(PyramidLevel(pyramid, spacing), spacing, x0, y0, pixel_width, pixel_height), MeshParameters());
+    }
+
+    /*
+        Indexed mesh of a height grid, one vertex per used sample shared by all its triangles
+        With lod_block set, each block is a quadtree refined near the path and where coarse quads
+        would miss the surface by more than lod_tolerance; every leaf is fanned from its center
+        through all leaf corners on its edges, so neighbours of different sizes never crack
+    */
+    static std::shared_ptr<ChTriangleMeshConnected> 
+        asChronoMesh(const HeightGrid& grid, const MeshParameters& params) {
+
+        auto mesh = chrono_types::make_shared<ChTriangleMeshConnected>();
+        std::vector<ChVector3d>& vertices = mesh->GetCoordsVertices();
+        std::vector<ChVector3i>& faces = mesh->GetIndicesVertexes();
+
+        int nx = grid.nx;
+        int ny = grid.ny;
+        double sp = grid.spacing;
+        if (nx < 2 || ny < 2) {
+            return mesh;
+        }
+
+        if (params.lod_block <= 1) {
+            vertices.resize((size_t)nx * ny);
+            faces.resize((size_t)2 * (nx - 1) * (ny - 1));
+
+            #pragma omp parallel for schedule(static)
+            for (int iy = 0; iy < ny; iy++) {
+                for (int ix = 0; ix < nx; ix++) {
+                    vertices[(size_t)iy * nx + ix] = ChVector3d(grid.x0 + ix * sp, grid.y0 + iy * sp, grid.at(ix, iy));
+                }
+            }
+
+            #pragma omp parallel for schedule(static)
+            for (int iy = 0; iy < ny - 1; iy++) {
+                for (int ix = 0; ix < nx - 1; ix++) {
+                    int v0 = iy * nx + ix;
+                    int v1 = v0 + 1;
+                    int v2 = v0 + nx + 1;
+                    int v3 = v0 + nx;
+                    size_t k = 2 * ((size_t)iy * (nx - 1) + ix);
+                    faces[k] = ChVector3i(v0, v1, v2);
+                    faces[k + 1] = ChVector3i(v0, v2, v3);
+                }
+            }
+            return mesh;
+        }
+
+        int block = 1;
+        while (block * 2 <= params.lod_block) {
+            block *= 2;
+        }
+
+        std::vector<float> dist;
+        if (!params.path.empty()) {
+            dist = PathDistance(grid, params.path, params.lod_keep_radius);
+        }
+
+        // Quads are split when near the path or when bilinear interpolation of their corners misses a sample
+        auto needs_refine = [&](int ix, int iy, int size) {
+            float z00 = grid.at(ix, iy);
+            float z10 = grid.at(ix + size, iy);
+            float z01 = grid.at(ix, iy + size);
+            float z11 = grid.at(ix + size, iy + size);
+            for (int j = 0; j <= size; j++) {
+                for (int i = 0; i <= size; i++) {
+                    if (!dist.empty() && dist[(size_t)(iy + j) * nx + ix + i] <= params.lod_keep_radius) {
+                        return true;
+                    }
+                    float u = (float)i / size;
+                    float v = (float)j / size;
+                    float a = z00 + u * (z10 - z00);
+                    float b = z01 + u * (z11 - z01);
+                    if (std::fabs(grid.at(ix + i, iy + j) - (a + v * (b - a))) > params.lod_tolerance) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        };
+
+        struct Leaf {
+            int ix;
+            int iy;
+            int size;
+        };
+        std::vector<Leaf> leaves;
+        std::vector<uint8_t> corner((size_t)nx * ny, 0);
+
+        std::function<void(int, int, int)> refine = [&](int ix, int iy, int size) {
+            if (ix >= nx - 1 || iy >= ny - 1) {
+                return;
+            }
+            bool inside = ix + size <= nx - 1 && iy + size <= ny - 1;
+            if (size > 1 && (!inside || needs_refine(ix, iy, size))) {
+                int half = size / 2;
+                refine(ix, iy, half);
+                refine(ix + half, iy, half);
+                refine(ix, iy + half, half);
+                refine(ix + half, iy + half, half);
+                return;
+            }
+            leaves.push_back({ix, iy, size});
+            corner[(size_t)iy * nx + ix] = 1;
+            corner[(size_t)iy * nx + ix + size] = 1;
+            corner[(size_t)(iy + size) * nx + ix] = 1;
+            corner[(size_t)(iy + size) * nx + ix + size] = 1;
+        };
+
+        for (int by = 0; by < ny - 1; by += block) {
+            for (int bx = 0; bx < nx - 1; bx += block) {
+                refine(bx, by, block);
             }
         }
 
-        for (int j = 0; j <  pixel_height - 1; ++j) {
-            for (int i = 0; i < pixel_width - 1; ++i) {
-                int v0 = j * pixel_width + i;
-                int v1 = j * pixel_height + (i + 1);
-                int v2 = (j + 1) * pixel_width + (i + 1);
-                int v3 = (j + 1) * pixel_width + i;
+        // Vertex indices for the samples actually used, positions filled in parallel afterwards
+        std::vector<int> index((size_t)nx * ny, -1);
+        std::vector<size_t> samples;
+        auto vertex = [&](int ix, int iy) {
+            size_t k = (size_t)iy * nx + ix;
+            if (index[k] < 0) {
+                index[k] = samples.size();
+                samples.push_back(k);
+            }
+            return index[k];
+        };
+
+        std::vector<int> ring;
+        for (const auto& leaf : leaves) {
+            int x0 = leaf.ix;
+            int y0 = leaf.iy;
+            int n = leaf.size;
+
+            if (n == 1) {
+                int v0 = vertex(x0, y0);
+                int v1 = vertex(x0 + 1, y0);
+                int v2 = vertex(x0 + 1, y0 + 1);
+                int v3 = vertex(x0, y0 + 1);
+                faces.push_back(ChVector3i(v0, v1, v2));
+                faces.push_back(ChVector3i(v0, v2, v3));
+                continue;
+            }
+
+            // Counter-clockwise boundary through every leaf corner on the edges
+            ring.clear();
+            for (int i = 0; i < n; i++) {
+                if (corner[(size_t)y0 * nx + x0 + i]) ring.push_back(vertex(x0 + i, y0));
+            }
+            for (int j = 0; j < n; j++) {
+                if (corner[(size_t)(y0 + j) * nx + x0 + n]) ring.push_back(vertex(x0 + n, y0 + j));
+            }
+            for (int i = n; i > 0; i--) {
+                if (corner[(size_t)(y0 + n) * nx + x0 + i]) ring.push_back(vertex(x0 + i, y0 + n));
+            }
+            for (int j = n; j > 0; j--) {
+                if (corner[(size_t)(y0 + j) * nx + x0]) ring.push_back(vertex(x0, y0 + j));
+            }
 
-                mesh->AddTriangle(ChTriangle(vertices[v0], vertices[v1], vertices[v2]));
-                mesh->AddTriangle(ChTriangle(vertices[v0], vertices[v2], vertices[v3]));
+            int center = vertex(x0 + n / 2, y0 + n / 2);
+            for (size_t k = 0; k < ring.size(); k++) {
+                faces.push_back(ChVector3i(center, ring[k], ring[(k + 1) % ring.size()]));
             }
         }
+
+        vertices.resize(samples.size());
+        #pragma omp parallel for schedule(static)
+        for (long v = 0; v < (long)samples.size(); v++) {
+            int ix = samples[v] % nx;
+            int iy = samples[v] / nx;
+            vertices[v] = ChVector3d(grid.x0 + ix * sp, grid.y0 + iy * sp, grid.at(ix, iy));
+        }
+
+        std::cout << "LOD mesh: " << vertices.size() << " vertices, " << faces.size() << " triangles (full resolution "
+                  << (size_t)nx * ny << ", " << (size_t)2 * (nx - 1) * (ny - 1) << ")" << std::endl;
         return mesh;
     }
 
 
+    /*
+        Distance from every column of layout to the path, infinity beyond reach
+        Each segment only visits the columns inside its own bounding box
+    */
+    static std::vector<float> PathDistance(const HeightGrid& layout, const std::vector<ChVector2d>& path, double reach) {
+        int Nx = layout.nx;
+        int Ny = layout.ny;
+        double sp = layout.spacing;
+
+        std::vector<float> dist((size_t)Nx * Ny, std::numeric_limits<float>::infinity());
+
+        for (size_t k = 0; k < path.size(); k++) {
+            ChVector2d a = path[k];
+            ChVector2d b = path[std::min(k + 1, path.size() - 1)];
+            ChVector2d ab = b - a;
+            double len2 = ab.Length2();
+
+            int ix_lo = std::max(0, (int)std::floor((std::min(a.x(), b.x()) - reach - layout.x0) / sp));
+            int ix_hi = std::min(Nx - 1, (int)std::ceil((std::max(a.x(), b.x()) + reach - layout.x0) / sp));
+            int iy_lo = std::max(0, (int)std::floor((std::min(a.y(), b.y()) - reach - layout.y0) / sp));
+            int iy_hi = std::min(Ny - 1, (int)std::ceil((std::max(a.y(), b.y()) + reach - layout.y0) / sp));
+
+            for (int iy = iy_lo; iy <= iy_hi; iy++) {
+                for (int ix = ix_lo; ix <= ix_hi; ix++) {
+                    ChVector2d p(layout.x0 + ix * sp, layout.y0 + iy * sp);
+                    double t = len2 > 0 ? std::clamp((p - a).Dot(ab) / len2, 0.0, 1.0) : 0.0;
+                    float d = (p - (a + ab * t)).Length();
+                    float& best = dist[(size_t)iy * Nx + ix];
+                    best = std::min(best, d);
+                }
+            }
+        }
+        return dist;
+    }
+
+    /*
+        Classify every column of layout by its distance to the path: soil within buffer, BCE wall
+        in a band of wall_width beyond it, empty elsewhere
+    */
+    static std::vector<uint8_t> CorridorColumns(const HeightGrid& layout, const std::vector<ChVector2d>& path, double buffer, double wall_width) {
+        double reach = buffer + wall_width;
+        std::vector<float> dist = PathDistance(layout, path, reach);
+
+        std::vector<uint8_t> columns(dist.size(), kColumnEmpty);
+        for (size_t k = 0; k < dist.size(); k++) {
+            if (dist[k] <= buffer) {
+                columns[k] = kColumnSoil;
+            } else if (dist[k] <= reach) {
+                columns[k] = kColumnWall;
+            }
+        }
+        return columns;
+    }
+
+    /*
+        Per-column soil depth [m] from the expected wheel sinkage: kSinkageDepthFactor x sinkage within
+        wheel_band of the path, kMinDepthLayers particles elsewhere, ramped at 45 degrees in between
+    */
+    static std::vector<float> ColumnDepths(const HeightGrid& layout, const std::vector<ChVector2d>& path, const SoilParameters& params) {
+        double shallow = kMinDepthLayers * layout.spacing;
+        double deep = std::max(kSinkageDepthFactor * params.expected_sinkage, shallow);
+        double ramp = deep - shallow;
+
+        std::vector<float> depths = PathDistance(layout, path, params.wheel_band + ramp);
+        size_t deep_columns = 0;
+        for (auto& d : depths) {
+            double t = ramp > 0 ? std::clamp((d - params.wheel_band) / ramp, 0.0, 1.0) : (d <= params.wheel_band ? 0.0 : 1.0);
+            deep_columns += t == 0.0;
+            d = deep + t * (shallow - deep);
+        }
+
+        std::cout << "Adaptive depth: " << deep << " m under " << deep_columns << "/" << depths.size()
+                  << " columns, " << shallow << " m elsewhere" << std::endl;
+        return depths;
+    }
+
     /*
         Construct SPH box
     */
@@ -136,28 +1905,17 @@ public:
         int Ny = std::round(box_size.y() / m_spacing) + 1;
         int Nz = std::round(box_size.z() / m_spacing) + 1;
 
-        // Reserve space for containers
-        int num_sph = Nx * Ny * Nz;
-
-        std::vector<ChVector3i> sph;
-        sph.reserve(num_sph);
+        // One run of Nz points per column
+        ChFsiProblemSPH::ColumnRuns sph;
+        sph.reserve((size_t)Nx * Ny);
 
         // Generate SPH points
         for (int Ix = 0; Ix < Nx; Ix++) {
             for (int Iy = 0; Iy < Ny; Iy++) {
-                for (int Iz = 0; Iz < Nz; Iz++) {
-                    sph.push_back(ChVector3i(Ix, Iy, Iz));  // SPH particles above 0
-                }
+                sph.push_back({Ix, Iy, 0, Nz});  // SPH particles above 0
             }
         }
 
-        ChFsiProblemSPH::GridPoints m_sph;
-
-        // // Insert in cached sets
-        for (auto& p : sph) {
-            m_sph.insert(p);
-        }
-
         // if (m_verbose) {
         //     cout << "  Particle grid size:      " << Nx << " " << Ny << " " << Nz << endl;
         //     cout << "  Num. SPH particles:      " << m_sph.size() << " (" << sph.size() << ")" << endl;
@@ -166,7 +1924,7 @@ public:
 
         ChVector3d m_offset_sph = pos - ChVector3d(box_size.x() / 2, box_size.y() / 2, 0);
 
-        terr.SetSPHPoints(m_sph, m_offset_sph);
+        terr.SetSPHColumns(std::move(sph), m_offset_sph);
 
         if (side_flags != BoxSide::NONE)
             terr.AddBoxContainer(box_size, pos, side_flags);
@@ -179,92 +1937,217 @@ public:
     static void 
     Construct(CRMTerrain& terr, std::shared_ptr<rsvp::ImageData> image, const double& m_spacing, const ChVector2d& box_size, const ChVector3f& rover_pos_o, int side_flags) {
 
-        // Find heights to offset against
-        double z_min = 1000;
-        double z_max = -1000;
-
         double y_off = 0.0;
-        // double z_off = 0.11;
-        double z_off = 0.0;
 
         ChVector3f rover_pos = ChVector3f(rover_pos_o.x(),rover_pos_o.y() + y_off, rover_pos_o.z());
 
-        for(float x = -box_size.x()*0.5f; x < box_size.x()*0.5f; x+=m_spacing) {
-            for(float y = -box_size.y()*0.5f; y < box_size.y()*0.5f; y+=m_spacing) {
-                double z = -1;
-                image->get_interpolated_pixel_double(z, x + rover_pos.x(),y + rover_pos.y(), 1);
-                // z = -z; // flip to site frame
-                z_min = std::min(z,z_min);
-                z_max = std::max(z,z_max);
+        // Bake the composite once at column spacing; z_min/z_max come from the same pass
+        HeightGrid layout = ColumnLayout(m_spacing, box_size, rover_pos);
+        HeightGrid grid = SampleGrid(image, m_spacing, layout.x0, layout.y0, layout.nx, layout.ny);
+
+        Construct(terr, grid, SoilParameters(), std::vector<uint8_t>(), std::vector<float>());
+    }
+
+    /*
+        Construct CRMTerrain from sampled column heights, restricted to the soil columns
+        of a corridor classification (every column is soil when columns is empty)
+        Soil is params.depth deep unless depths gives a per-column depth [m]
+    */
+    static void 
+    Construct(CRMTerrain& terr, const HeightGrid& grid, const SoilParameters& params, const std::vector<uint8_t>& columns, const std::vector<float>& depths) {
+        ApplyPlan(terr, PlanColumns(grid, params, columns, depths));
+    }
+
+    /*
+        Terrain part of a settled-state key: the point-set snapshot key plus the soil and solver settings
+        the plan does not depend on
+    */
+    static uint64_t CheckpointKey(uint64_t snapshot_key, const SoilParameters& params, double step_size) {
+        uint64_t key = CacheUtils::HashValue(params.density, snapshot_key);
+        key = CacheUtils::HashValue(params.cohesion, key);
+        key = CacheUtils::HashValue(params.friction, key);
+        key = CacheUtils::HashValue(params.youngs_modulus, key);
+        key = CacheUtils::HashValue(params.poisson_ratio, key);
+        key = CacheUtils::HashValue(params.active_domain, key);
+        key = CacheUtils::HashValue(params.max_wheel_speed, key);
+        key = CacheUtils::HashValue(kProximitySearchSteps, key);
+        return CacheUtils::HashValue(step_size, key);
+    }
+
+    /*
+        SPH particle state of a CRM terrain, for a settled-state checkpoint
+    */
+    static void CaptureParticles(CRMTerrain& terrain, SettleCheckpoint::State& state) {
+        auto& sysSPH = terrain.GetFluidSystemSPH();
+        state.positions = sysSPH.GetParticlePositions();
+        state.velocities = sysSPH.GetParticleVelocities();
+        state.properties = sysSPH.GetParticleFluidProperties();
+        state.stress_diag = sysSPH.GetParticleStressDiagonal();
+        state.stress_off = sysSPH.GetParticleStressOffDiagonal();
+    }
+
+    /*
+        Add checkpointed particles to a terrain before Initialize (in place of the planned SPH columns)
+    */
+    static void AddParticles(CRMTerrain& terrain, const SettleCheckpoint::State& state) {
+        auto& sysSPH = terrain.GetFluidSystemSPH();
+        for (size_t i = 0; i < state.positions.size(); i++) {
+            const auto& p = state.properties[i];
+            sysSPH.AddSPHParticle(state.positions[i], p.x(), p.y(), p.z(), state.velocities[i], state.stress_diag[i], state.stress_off[i]);
+        }
+    }
+
+    /*
+        Active box around each wheel (full edge lengths) unless params.active_domain overrides it
+        The box holds the wheel in any roll and steer angle, the kernel support of its markers, and the
+        distance the hub covers at max_wheel_speed between two refreshes of the active domain. sysSPH only
+        re-flags active particles at its neighbor searches, so the refresh interval is read from its
+        proximity search period and CFD step size; call this after SetSPHParameters and SetStepSizeCFD.
+    */
+    static ChVector3d ActiveDomainSize(const std::pair<WheelMarkers::Markers, WheelMarkers::Markers>& markers, const ChFsiFluidSystemSPH& sysSPH, const SoilParameters& params) {
+        if (params.active_domain.x() > 0 && params.active_domain.y() > 0 && params.active_domain.z() > 0) {
+            return params.active_domain;
+        }
+
+        // Markers are in the wheel frame, the axle along y; the left cloud sits off center
+        double radius = 0.0;
+        double half_width = 0.0;
+        for (const auto& cloud : { markers.first, markers.second }) {
+            for (const auto& p : *cloud) {
+                radius = std::max(radius, std::sqrt(p.x() * p.x() + p.z() * p.z()));
+                half_width = std::max(half_width, std::fabs(p.y()));
             }
         }
 
-        double height =  (z_max - z_min);
+        double refresh_interval = sysSPH.GetNumProximitySearchSteps() * sysSPH.GetStepSize();
+        double travel = params.max_wheel_speed * radius * refresh_interval;
+        double margin = 2 * sysSPH.GetKernelLength() + travel;
+        double planar = 2 * std::sqrt(radius * radius + half_width * half_width) + 2 * margin;
+        ChVector3d size(planar, planar, 2 * radius + 2 * margin);
+
+        std::cout << "[HeightmapParser] Active domain " << size.x() << " x " << size.y() << " x " << size.z()
+                  << " m per wheel (" << travel << " m of wheel travel per " << refresh_interval << " s refresh)" << std::endl;
+        return size;
+    }
+
+    /*
+        SPH particles inside the union of the wheels' active boxes (axis aligned, centered on each hub)
+        One box query per wheel, so sample it at the logging rate rather than every step
+    */
+    static size_t CountActiveParticles(CRMTerrain& terrain, const std::vector<std::shared_ptr<ChBody>>& wheels, const ChVector3d& size) {
+        auto& sysSPH = terrain.GetFluidSystemSPH();
+        std::vector<int> active;
+        for (const auto& wheel : wheels) {
+            auto indices = sysSPH.FindParticlesInBox(ChFrame<>(wheel->GetPos(), QUNIT), size);
+            active.insert(active.end(), indices.begin(), indices.end());
+        }
+        std::sort(active.begin(), active.end());
+        return std::unique(active.begin(), active.end()) - active.begin();
+    }
+
+    /*
+        Hand a column plan to the terrain (consumes the runs)
+    */
+    static void ApplyPlan(CRMTerrain& terr, ColumnPlan&& plan) {
+        terr.SetSPHColumns(std::move(plan.sph), plan.sph_offset);
+        terr.SetBCEColumns(std::move(plan.bce), plan.bce_offset);
+    }
+
+    /*
+        SPH and BCE column runs for sampled column heights, see Construct
+    */
+    static ColumnPlan PlanColumns(const HeightGrid& grid, const SoilParameters& params, const std::vector<uint8_t>& columns, const std::vector<float>& depths) {
+
+        // double z_off = 0.11;
+        double z_off = 0.0;
+
+        double m_spacing = grid.spacing;
+        double z_min = grid.z_min;
+        double z_max = grid.z_max;
 
-        ChVector3d box = { box_size.x(), box_size.y(), height };
+        double height =  (z_max - z_min);
 
         std::cout << "Minimum height: " << z_min << std::endl;
         std::cout << "Maximum height: " << z_max << std::endl;
         std::cout << "Height Range: " << height << std::endl;
 
-        // Number of points in each direction
-        int Nx = std::round(box.x() / m_spacing) + 1;
-        int Ny = std::round(box.y() / m_spacing) + 1;
-        int Nz = std::round(box.z() / m_spacing) + 1;
+        // Number of columns in each direction
+        int Nx = grid.nx;
+        int Ny = grid.ny;
+
+        // Column depths in grid points, matching the old per-point loops [zLim, zLim + depth)
+        int uniform_depth = std::ceil(params.depth / m_spacing); // meters / spacing
+        int bce_thickness = std::ceil(params.bce_thickness / m_spacing); // meters / spacing
+
+        // One SPH run and one BCE run per column, BCE directly beneath the SPH run
+        ColumnPlan plan;
+        ChFsiProblemSPH::ColumnRuns& sph = plan.sph;
+        ChFsiProblemSPH::ColumnRuns& bce = plan.bce;
+        sph.reserve((size_t)Nx * Ny);
+        bce.reserve((size_t)Nx * Ny);
 
-        std::vector<ChVector3i> sph;
-        std::vector<ChVector3i> bce;
         // Generate SPH points
         for (int Ix = 0; Ix < Nx; Ix++) {
             for (int Iy = 0; Iy < Ny; Iy++) {
-                float x = (Ix*m_spacing + rover_pos.x()) - (box.x()*0.5);
-                float y = (Iy*m_spacing + rover_pos.y()) - (box.y()*0.5);
+                uint8_t type = columns.empty() ? kColumnSoil : columns[(size_t)Iy * Nx + Ix];
+                if (type == kColumnEmpty) {
+                    continue;
+                }
 
-                double z = -1;
-                image->get_interpolated_pixel_double(z, x, y, 1);
-                // z = -z;
+                double z = grid.at(Ix, Iy);
                 
                 int zLim = std::round((z - z_min)/m_spacing);
-                double terr_depth = 0.3 / m_spacing; // meters / spacing
-                double bce_thickness = 0.1 / m_spacing; // meters / spacing
-                
-                for (int Iz = zLim; Iz < zLim + terr_depth; Iz++) {
-                    sph.push_back(ChVector3i(Ix, Iy, Iz));  // SPH particles above 0
-                }
-                
-                for (int Iz = zLim + terr_depth; Iz < zLim + terr_depth + bce_thickness; Iz++) {
-                    bce.push_back(ChVector3i(Ix, Iy, Iz));  // SPH particles above 0
+                int terr_depth = depths.empty() ? uniform_depth : (int)std::ceil(depths[(size_t)Iy * Nx + Ix] / m_spacing);
+
+                if (type == kColumnSoil) {
+                    sph.push_back({Ix, Iy, zLim, zLim + terr_depth});  // SPH particles above 0
+                    bce.push_back({Ix, Iy, zLim + terr_depth, zLim + terr_depth + bce_thickness});
+                } else {
+                    // Wall column from just above the surface down through the floor
+                    bce.push_back({Ix, Iy, zLim - bce_thickness, zLim + terr_depth + bce_thickness});
                 }
             }
         }
 
-        ChFsiProblemSPH::GridPoints m_sph;
-        ChFsiProblemSPH::GridPoints m_bce;
-
-        //  Insert in cached sets
-        for (auto& p : sph) {
-            m_sph.insert(p);
-        }
-
-        //  Insert in cached sets
-        for (auto& p : bce) {
-            m_bce.insert(p);
+        if (!columns.empty()) {
+            std::cout << "Corridor domain: " << sph.size() << "/" << (size_t)Nx * Ny << " soil columns, "
+                      << bce.size() - sph.size() << " wall columns" << std::endl;
         }
 
         double box_z = z_min - z_off;
 
-        ChVector3d m_offset_sph = ChVector3d(rover_pos.x(),rover_pos.y(), 0.0) - ChVector3d(box.x() / 2, box.y() / 2, -box_z);
-        ChVector3d m_offset_bce = ChVector3d(rover_pos.x(),rover_pos.y(), 0.0) - ChVector3d(box.x() / 2, box.y() / 2, -box_z);
-
-        terr.SetSPHPoints(m_sph, m_offset_sph);
-        terr.SetBCEPoints(m_bce, m_offset_bce);
+        plan.sph_offset = ChVector3d(grid.x0, grid.y0, box_z);
+        plan.bce_offset = ChVector3d(grid.x0, grid.y0, box_z);
 
         // terr.AddBoxContainer(box, rover_pos, BoxSide::);
 
+        return plan;
     }
 
 
-    static void InitializeCRMTerrain(PerseveranceUtils::RoverDefinition def, CRMTerrain& terrain, ChVector2d size, SoilParameters params, std::vector<std::string> mod_files, std::vector<std::string> ht_files, ChVector3d rover_pos, double step_size) 
+    /*
+        Simulation box of a domain: size around center, or for corridor domains fit to the path the
+        bounding box of the path, walls included
+    */
+    static void DomainBox(const DomainParameters& domain, const SoilParameters& params, ChVector2d& size, ChVector3d& center) {
+        if (domain.corridor && !domain.path.empty()) {
+            double wall_width = std::ceil(params.bce_thickness / params.spacing) * params.spacing;
+            ChVector2d lo = domain.path.front();
+            ChVector2d hi = domain.path.front();
+            for (const auto& p : domain.path) {
+                lo = ChVector2d(std::min(lo.x(), p.x()), std::min(lo.y(), p.y()));
+                hi = ChVector2d(std::max(hi.x(), p.x()), std::max(hi.y(), p.y()));
+            }
+            double reach = domain.buffer + wall_width + params.spacing;
+            size = (hi - lo) + ChVector2d(2 * reach, 2 * reach);
+            center = ChVector3d(0.5 * (lo.x() + hi.x()), 0.5 * (lo.y() + hi.y()), center.z());
+        }
+    }
+
+    /*
+        Returns the baked DEM so callers can query heights without touching the composite again
+    */
+    static HeightGrid InitializeCRMTerrain(PerseveranceUtils::RoverDefinition def, CRMTerrain& terrain, ChVector2d size, SoilParameters params, std::vector<std::string> mod_files, std::vector<std::string> ht_files, ChVector3d rover_pos, double step_size, DEMParameters dem, DomainParameters domain, SettleCheckpoint* checkpoint = nullptr) 
     {
         // /*/////////////////////
         //  *  Initialize Terrain 
@@ -275,29 +2158,63 @@ public:
         double width = 0.0;
         double height = 0.0;
 
-        auto compo_img = std::make_shared<rsvp::AverageCompositeData>();
-        // auto compo_img = std::make_shared<rsvp::AlphaBlendingCompositeData>();
+        double wall_width = std::ceil(params.bce_thickness / params.spacing) * params.spacing;
+        DomainBox(domain, params, size, rover_pos);
+
+        HeightGrid baked = LoadBakedDEM(mod_files, ht_files, params.spacing, size, rover_pos, dem);
+
+        // Generated points are deterministic in the baked DEM and settings, reuse them when cached
+        ColumnPlan plan;
+        uint64_t snapshot_key = 0;
+        std::string snapshot_file;
+        bool snapshot_hit = false;
+        if (!dem.cache_dir.empty()) {
+            snapshot_key = SnapshotKey(baked, ColumnLayout(params.spacing, size, rover_pos), params, domain);
+            snapshot_file = SnapshotPath(dem.cache_dir, snapshot_key);
+            snapshot_hit = LoadSnapshot(snapshot_file, snapshot_key, plan);
+            if (snapshot_hit) {
+                std::cout << "Loaded terrain snapshot " << snapshot_file << ": " << plan.sph.size() << " SPH, "
+                          << plan.bce.size() << " BCE columns" << std::endl;
+            }
+        }
 
+        if (!snapshot_hit) {
+            HeightGrid grid = ColumnGrid(baked, params.spacing, size, rover_pos);
 
-        for(const auto& mod_file : mod_files) {
-            auto img = HeightmapParser::ParseModFile((mod_file));
-            compo_img->add_image(img);
+            std::vector<uint8_t> columns;
+            if (domain.corridor && !domain.path.empty()) {
+                columns = CorridorColumns(grid, domain.path, domain.buffer, wall_width);
+            }
+
+            std::vector<float> depths;
+            if (params.expected_sinkage > 0 && !domain.path.empty()) {
+                depths = ColumnDepths(grid, domain.path, params);
+            }
+
+            plan = PlanColumns(grid, params, columns, depths);
+
+            if (!snapshot_file.empty()) {
+                if (StoreSnapshot(snapshot_file, snapshot_key, plan)) {
+                    std::cout << "Cached terrain snapshot " << snapshot_file << std::endl;
+                } else {
+                    std::cerr << "Warning: could not write terrain snapshot " << snapshot_file << std::endl;
+                }
+            }
         }
 
-        for(const auto& ht_file : ht_files) {
-            auto img = HeightmapParser::ParseHeightmap((ht_file));
-            compo_img->add_image(img);
+        // A settled state for this terrain replaces the generated particles, the BCE layer is still planned
+        if (checkpoint && !dem.cache_dir.empty() && checkpoint->Resolve(CheckpointKey(snapshot_key, params, step_size))) {
+            plan.sph.clear();
         }
         
-        
-        // auto mesh = HeightmapParser::asChronoMesh(compo_img, 0.05f, 20, 20, rover_x, rover_y);
+        // auto mesh = HeightmapParser::asChronoMesh(baked, 0.05f, 20, 20, rover_x, rover_y);
         // std::vector<chrono::ChTriangleMeshConnected> meshes { *mesh };
         // ChTriangleMeshConnected::WriteWavefront("test.obj", meshes);
 
         terrain.SetStepSizeCFD(step_size);
         terrain.SetGravitationalAcceleration(ChVector3d(0, 0, 3.7));
 
-        HeightmapParser::Construct(terrain, compo_img, params.spacing, size, rover_pos, BoxSide::ALL & ~BoxSide::Z_POS);
+        HeightmapParser::ApplyPlan(terrain, std::move(plan));
         
         ChFsiSystemSPH& sysFSI = terrain.GetSystemFSI();
 
@@ -327,6 +2244,7 @@ public:
         sph_params.consistent_laplacian_discretization = false;
         sph_params.viscosity_method = ViscosityMethod::ARTIFICIAL_BILATERAL;
         sph_params.boundary_method = BoundaryMethod::ADAMI;
+        sph_params.num_proximity_search_steps = kProximitySearchSteps;
         terrain.SetSPHParameters(sph_params);
 
 
@@ -334,30 +2252,28 @@ public:
         * Initialize FSI wheels
         */
 
-        // Add rover wheels as FSI bodies
+        // Add rover wheels as FSI bodies, marker clouds are sampled once per spacing and reused
         std::cout << "Create wheel BCE markers..." << std::endl;
-        std::string mesh_filename_r = GetChronoDataFile("M2020/meshes/Wheel_Col.obj");
-        std::shared_ptr<utils::ChBodyGeometry> geometry_r = std::make_shared<utils::ChBodyGeometry>();
-        geometry_r->materials.push_back(ChContactMaterialData());
-        geometry_r->coll_meshes.push_back(utils::ChBodyGeometry::TrimeshShape(VNULL, mesh_filename_r, VNULL));
-        
-        std::string mesh_filename_l = GetChronoDataFile("M2020/meshes/Wheel_Col_L.obj");
-        std::shared_ptr<utils::ChBodyGeometry> geometry_l = std::make_shared<utils::ChBodyGeometry>();
-        geometry_l->materials.push_back(ChContactMaterialData());
-        geometry_l->coll_meshes.push_back(utils::ChBodyGeometry::TrimeshShape(VNULL, mesh_filename_l, VNULL));
+        auto markers = WheelMarkers::Get(terrain.GetFluidSystemSPH(), params.spacing, dem.cache_dir);
 
-        ChVector3d active_box_dim(0.6, 0.6, 0.6);
+        ChVector3d active_box_dim = ActiveDomainSize(markers, terrain.GetFluidSystemSPH(), params);
         terrain.SetActiveDomain(active_box_dim);
 
         for(int i = 0; i < 6; i++) {
             if(i < 3) {
-                terrain.AddRigidBody(def.wheels[i],geometry_r,false);
+                terrain.AddRigidBody(def.wheels[i], *markers.first, false);
             } else {
-                terrain.AddRigidBody(def.wheels[i],geometry_l,false);
+                terrain.AddRigidBody(def.wheels[i], *markers.second, false);
             }
         }
+
+        if (checkpoint && checkpoint->IsRestored()) {
+            AddParticles(terrain, checkpoint->GetState());
+            checkpoint->ReleaseParticles();
+        }
         terrain.Initialize();
 
+        return baked;
     }
 
 
@@ -410,6 +2326,7 @@ public:
         sph_params.consistent_laplacian_discretization = false;
         sph_params.viscosity_method = ViscosityMethod::ARTIFICIAL_BILATERAL;
         sph_params.boundary_method = BoundaryMethod::ADAMI;
+        sph_params.num_proximity_search_steps = kProximitySearchSteps;
         terrain.SetSPHParameters(sph_params);
 
 
@@ -417,26 +2334,18 @@ public:
         * Initialize FSI wheels
         */
 
-        // Add rover wheels as FSI bodies
+        // Add rover wheels as FSI bodies, marker clouds are sampled once per spacing and reused
         std::cout << "Create wheel BCE markers..." << std::endl;
-        std::string mesh_filename_r = GetChronoDataFile("M2020/meshes/Wheel_Col.obj");
-        std::shared_ptr<utils::ChBodyGeometry> geometry_r = std::make_shared<utils::ChBodyGeometry>();
-        geometry_r->materials.push_back(ChContactMaterialData());
-        geometry_r->coll_meshes.push_back(utils::ChBodyGeometry::TrimeshShape(VNULL, mesh_filename_r, VNULL));
-        
-        std::string mesh_filename_l = GetChronoDataFile("M2020/meshes/Wheel_Col_L.obj");
-        std::shared_ptr<utils::ChBodyGeometry> geometry_l = std::make_shared<utils::ChBodyGeometry>();
-        geometry_l->materials.push_back(ChContactMaterialData());
-        geometry_l->coll_meshes.push_back(utils::ChBodyGeometry::TrimeshShape(VNULL, mesh_filename_l, VNULL));
+        auto markers = WheelMarkers::Get(terrain.GetFluidSystemSPH(), params.spacing, "");
 
-        ChVector3d active_box_dim(0.6, 0.6, 0.6);
+        ChVector3d active_box_dim = ActiveDomainSize(markers, terrain.GetFluidSystemSPH(), params);
         terrain.SetActiveDomain(active_box_dim);
 
         for(int i = 0; i < 6; i++) {
             if(i < 3) {
-                terrain.AddRigidBody(def.wheels[i],geometry_r,false);
+                terrain.AddRigidBody(def.wheels[i], *markers.first, false);
             } else {
-                terrain.AddRigidBody(def.wheels[i],geometry_l,false);
+                terrain.AddRigidBody(def.wheels[i], *markers.second, false);
             }
         }
         terrain.Initialize();
@@ -0,0 +1,138 @@
+#ifndef PERSEVERENCE_GUARDS_H
+#define PERSEVERENCE_GUARDS_H
+
+#include <cmath>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "chrono_vehicle/terrain/CRMTerrain.h"
+#include "heightmap_parser.h"
+#include "perseverance_score.h"
+
+using namespace chrono;
+using namespace chrono::vehicle;
+
+/*
+    Divergence guards of the drive, so a soil candidate that sinks, flips or blows the SPH up ends the trial
+    early instead of running to t_fin
+
+    Checked every check_interval of drive time against the state at the start of the drive: non-finite body
+    states, position error against the telemetry (from the running score), chassis tilt away from the world
+    vertical, and chassis height above the DEM drifting from its starting clearance. SPH particle speeds above
+    a bound for particle_duration in a row are checked every particle_interval only, since that copies every
+    particle velocity off the device. A limit of 0 disables its guard.
+*/
+class PerseveranceGuards {
+public:
+
+    struct Parameters {
+        double check_interval = 0.1;     // [s] drive time between checks
+        double position_error = 2.0;     // [m] distance to the interpolated telemetry position
+        double tilt = 45.0;              // [deg] chassis up axis away from the vertical
+        double height = 0.5;             // [m] change of chassis clearance above the DEM
+        double particle_speed = 5.0;     // [m/s] fastest SPH particle
+        double particle_duration = 1.0;  // [s] the particle bound must be exceeded this long
+        double particle_interval = 0.5;  // [s] drive time between particle speed checks
+    };
+
+private:
+    Parameters m_params;
+    std::shared_ptr<ChBody> m_chassis;
+    std::vector<std::shared_ptr<ChBody>> m_bodies;
+    const HeightmapParser::HeightGrid* m_dem = nullptr;
+    const PerseveranceScore* m_score = nullptr;
+
+    bool m_started = false;
+    double m_next_check = 0;
+    double m_next_particle_check = 0;
+    double m_clearance = 0;   // [m] chassis clearance at the start of the drive
+    double m_up_sign = 1;     // world z sign of the chassis up axis at the start (the site frame is z down)
+    double m_fast_since = -1; // [s] drive time the particle bound was first exceeded, -1 when below
+
+public:
+
+    /*
+        Bodies in RoverDefinition order; dem and score (may be null, no position guard then) must outlive the guards
+    */
+    void Initialize(const Parameters& params, std::shared_ptr<ChBody> chassis, const std::vector<std::shared_ptr<ChBody>>& bodies,
+                    const HeightmapParser::HeightGrid* dem, const PerseveranceScore* score) {
+        m_params = params;
+        m_chassis = chassis;
+        m_bodies = bodies;
+        m_dem = dem;
+        m_score = score;
+    }
+
+    /*
+        Check the guards at drive time t [s], returns why the drive diverged or an empty string
+    */
+    std::string Check(double t, CRMTerrain* terrain) {
+        if (m_started && t < m_next_check) {
+            return "";
+        }
+        m_next_check = t + m_params.check_interval;
+
+        std::ostringstream reason;
+        for (const auto& body : m_bodies) {
+            ChVector3d pos = body->GetPos();
+            ChQuaterniond rot = body->GetRot();
+            ChVector3d vel = body->GetPosDt();
+            if (!std::isfinite(pos.x() + pos.y() + pos.z() + rot.e0() + rot.e1() + rot.e2() + rot.e3() + vel.x() + vel.y() + vel.z())) {
+                reason << "non-finite state of " << body->GetName();
+                return reason.str();
+            }
+        }
+
+        ChVector3d pos = m_chassis->GetPos();
+        double up = m_chassis->GetRot().GetAxisZ().z();
+        double clearance = pos.z() - HeightmapParser::HeightAt(*m_dem, pos.x(), pos.y());
+        if (!m_started) {
+            m_started = true;
+            m_clearance = clearance;
+            m_up_sign = up < 0 ? -1 : 1;
+        }
+
+        if (m_params.position_error > 0 && m_score) {
+            double error = m_score->GetResiduals().position_error;
+            if (error > m_params.position_error) {
+                reason << "position error " << error << " m";
+                return reason.str();
+            }
+        }
+
+        double tilt = std::acos(std::fmax(-1.0, std::fmin(1.0, m_up_sign * up))) * 180.0 / CH_PI;
+        if (m_params.tilt > 0 && tilt > m_params.tilt) {
+            reason << "tilt " << tilt << " deg";
+            return reason.str();
+        }
+
+        if (m_params.height > 0 && std::fabs(clearance - m_clearance) > m_params.height) {
+            reason << "clearance change " << clearance - m_clearance << " m";
+            return reason.str();
+        }
+
+        if (m_params.particle_speed > 0 && terrain && t >= m_next_particle_check) {
+            m_next_particle_check = t + m_params.particle_interval;
+            double speed = 0;
+            for (const auto& v : terrain->GetFluidSystemSPH().GetParticleVelocities()) {
+                speed = std::fmax(speed, v.Length());
+            }
+            if (!(speed <= m_params.particle_speed)) {
+                if (m_fast_since < 0) {
+                    m_fast_since = t;
+                }
+                if (t - m_fast_since >= m_params.particle_duration) {
+                    reason << "particle speed " << speed << " m/s for " << t - m_fast_since << " s";
+                    return reason.str();
+                }
+            } else {
+                m_fast_since = -1;
+            }
+        }
+
+        return "";
+    }
+};
+
+#endif
@@ -2,8 +2,10 @@
 #define PERSEVERENCE_LOGGER_H
 
 #include "chrono_parsers/ChParserURDF.h"
+#include "perseverance_score.h"
 #include <iostream>
 #include <fstream>
+#include <functional>
 #include <stdexcept>
 
 using namespace chrono::parsers;
@@ -23,12 +25,35 @@ private:
 
     double m_slow_slip = 0.0;
 
+    // Extra channels appended after the standard columns, sampled only on logged steps
+    std::vector<std::string> m_extra_names;
+    std::vector<std::function<void(std::vector<double>&)>> m_extra_samples;
+    std::vector<double> m_extra_values;
+
+    PerseveranceScore* m_score = nullptr;
+
 public:
 
     void SetClock(double clock) {
         m_clock = clock;
     }
     
+    /*
+        Append channels to every row, in call order; must be called before Initialize
+        sample fills one value per name
+    */
+    void AddChannels(const std::vector<std::string>& names, std::function<void(std::vector<double>&)> sample) {
+        m_extra_names.insert(m_extra_names.end(), names.begin(), names.end());
+        m_extra_samples.push_back(sample);
+    }
+
+    /*
+        Feed every logged row to score as well
+    */
+    void SetScore(PerseveranceScore* score) {
+        m_score = score;
+    }
+
     void Initialize(std::shared_ptr<ChBody> chassis, ChParserURDF* parser, std::string filename, double logging_rate = 0.2) {
         m_chassis = chassis;
         m_parser = parser;
@@ -38,7 +63,11 @@ public:
         if(!log_file.is_open()) {
             throw std::runtime_error(("[Logger] Error opening file at " + m_filename));
         }
-        log_file << "m_clock,x,y,z,q_x,q_y,q_z,q_w,rf_s,rr_s,fl_s,rl_s,lr_d,rr_d,fl_d,fr_d,rm_d,lm_d,lb_rot,rb_rot,ld_rot,rd_rot,slip,slow_slip,wrf_x,wrf_y,wrf_z,wrc_x,wrc_y,wrc_z,wrb_x,wrb_y,wrb_z,wlf_x,wlf_y,wlf_z,wlc_x,wlc_y,wlc_z,wlb_x,wlb_y,wlb_z" << std::endl;
+        log_file << "m_clock,x,y,z,q_x,q_y,q_z,q_w,rf_s,rr_s,fl_s,rl_s,lr_d,rr_d,fl_d,fr_d,rm_d,lm_d,lb_rot,rb_rot,ld_rot,rd_rot,slip,slow_slip,wrf_x,wrf_y,wrf_z,wrc_x,wrc_y,wrc_z,wrb_x,wrb_y,wrb_z,wlf_x,wlf_y,wlf_z,wlc_x,wlc_y,wlc_z,wlb_x,wlb_y,wlb_z";
+        for (const auto& name : m_extra_names) {
+            log_file << "," << name;
+        }
+        log_file << std::endl;
     }
 
     void Advance(double slow_slip, double dt) {
@@ -127,7 +156,17 @@ public:
             log_file << WLB.x() << ", ";
             log_file << WLB.y() << ", ";
             log_file << WLB.z() << "";
+            for (const auto& sample : m_extra_samples) {
+                sample(m_extra_values);
+                for (double v : m_extra_values) {
+                    log_file << ", " << v;
+                }
+            }
             log_file << std::endl;
+
+            if (m_score) {
+                m_score->Add({ m_clock, m_chassis->GetFrameRefToAbs().GetPos(), slip, quat_ned, -lb_rot, -rb_rot });
+            }
         }
         m_clock += dt;
     }
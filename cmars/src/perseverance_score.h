@@ -0,0 +1,202 @@
+#ifndef PERSEVERENCE_SCORE_H
+#define PERSEVERENCE_SCORE_H
+
+#include "chrono/core/ChVector3.h"
+#include "chrono/core/ChQuaternion.h"
+#include "perseverance_utils.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace chrono;
+
+/*
+    Running residuals of the simulated drive against the downlink telemetry, the online counterpart of
+    compute_score in run_bay_opt.py
+
+    The telemetry CSV is read once over [t_init, t_init + t_fin] and every logged sample is compared with
+    it, linearly interpolated (clamped at the ends) like np.interp: position SSE, slip MAE, XYZ Euler angle
+    MAE [deg] and 10x the SSE of the bogie angles against the differentials (when the telemetry has them).
+    compute_score clips the telemetry to the logged span instead, which only differs for drives that end
+    before t_fin and then only for the last samples.
+*/
+class PerseveranceScore {
+public:
+
+    struct Sample {
+        double time;         // SCLK [s]
+        ChVector3d pos;
+        double slip;
+        ChQuaterniond rot;
+        double bogie_left;   // logged lb_rot / rb_rot
+        double bogie_right;
+    };
+
+    struct Residuals {
+        size_t samples = 0;
+        double residual = 0;       // position SSE [m^2]
+        double slip_residual = 0;  // slip MAE
+        double rot_residual = 0;   // Euler XYZ MAE [deg]
+        double diff_residual = 0;  // 10 x differential SSE [rad^2], NaN without differential telemetry
+        double combined = 0;       // 10 x slip_residual + residual
+        double t_end = 0;          // SCLK of the last sample
+        double position_error = 0; // [m] distance to the telemetry at the last sample
+    };
+
+private:
+    // Telemetry index, sorted by SCLK
+    std::vector<double> m_time;
+    std::vector<ChVector3d> m_pos;
+    std::vector<double> m_slip;
+    std::vector<ChVector3d> m_euler;
+    std::vector<double> m_diff_left;
+    std::vector<double> m_diff_right;
+
+    double m_last_slip = std::nan("");
+    double m_slip_sum = 0;
+    double m_rot_sum = 0;
+    Residuals m_residuals;
+
+public:
+
+    void Initialize(const std::string& csv, double t_init, double t_fin) {
+        std::ifstream inputFile(csv);
+
+        if (!inputFile.is_open()) {
+            throw std::runtime_error("[Score] Error opening telemetry CSV " + csv);
+        }
+
+        std::string header;
+        std::getline(inputFile, header);
+        int sclk = PerseveranceUtils::CsvColumn(header, "SCLK");
+        int x = PerseveranceUtils::CsvColumn(header, "ROVER_X [METERS]");
+        int y = PerseveranceUtils::CsvColumn(header, "ROVER_Y [METERS]");
+        int z = PerseveranceUtils::CsvColumn(header, "ROVER_Z [METERS]");
+        int slip = PerseveranceUtils::CsvColumn(header, "SLIP");
+        int qx = PerseveranceUtils::CsvColumn(header, "QUAT_X");
+        int qy = PerseveranceUtils::CsvColumn(header, "QUAT_Y");
+        int qz = PerseveranceUtils::CsvColumn(header, "QUAT_Z");
+        int qw = PerseveranceUtils::CsvColumn(header, "QUAT_C");
+        int diff_left = PerseveranceUtils::CsvColumn(header, "LEFT_DIFFERENTIAL");
+        int diff_right = PerseveranceUtils::CsvColumn(header, "RIGHT_DIFFERENTIAL");
+        if (sclk < 0 || x < 0 || y < 0 || z < 0 || slip < 0 || qx < 0 || qy < 0 || qz < 0 || qw < 0) {
+            throw std::runtime_error("[Score] Telemetry CSV " + csv + " lacks SCLK, ROVER_X/Y/Z, QUAT_X/Y/Z/C or SLIP");
+        }
+        bool diff = diff_left >= 0 && diff_right >= 0;
+
+        for (std::string line; std::getline(inputFile, line);) {
+            std::vector<double> tokens = PerseveranceUtils::CsvTokens(line);
+            if ((int)tokens.size() <= std::max({ sclk, x, y, z, slip, qx, qy, qz, qw, diff_left, diff_right })) {
+                continue;
+            }
+            // Rows the sampled drive can reach, compute_score drops the others the same way
+            if (tokens[sclk] <= t_init || tokens[sclk] >= t_init + t_fin) {
+                continue;
+            }
+            m_time.push_back(tokens[sclk]);
+            m_pos.push_back(ChVector3d(tokens[x], tokens[y], tokens[z]));
+            m_slip.push_back(tokens[slip]);
+            m_euler.push_back(EulerXYZ(ChQuaterniond(tokens[qw], tokens[qx], tokens[qy], tokens[qz])));
+            if (diff) {
+                m_diff_left.push_back(tokens[diff_left]);
+                m_diff_right.push_back(tokens[diff_right]);
+            }
+        }
+
+        if (m_time.empty()) {
+            std::cerr << "Warning: no telemetry in [t_init, t_init + t_fin] of " << csv << ", residuals stay NaN" << std::endl;
+        }
+    }
+
+    /*
+        Add one logged sample to the running residuals
+    */
+    void Add(const Sample& sample) {
+        m_residuals.samples++;
+        m_residuals.t_end = sample.time;
+        if (m_time.empty()) {
+            m_residuals.residual = m_residuals.slip_residual = m_residuals.rot_residual = std::nan("");
+            m_residuals.diff_residual = m_residuals.combined = m_residuals.position_error = std::nan("");
+            return;
+        }
+
+        size_t i;
+        double w;
+        Bracket(sample.time, i, w);
+
+        ChVector3d pos = m_pos[i] * (1 - w) + m_pos[i + (w > 0)] * w;
+        m_residuals.residual += (sample.pos - pos).Length2();
+        m_residuals.position_error = (sample.pos - pos).Length();
+
+        // Telemetry slip gaps carry the last known value forward
+        double slip = m_slip[i] * (1 - w) + m_slip[i + (w > 0)] * w;
+        if (std::isnan(slip)) {
+            slip = m_last_slip;
+        }
+        m_last_slip = slip;
+        m_slip_sum += std::fabs(sample.slip - slip);
+
+        ChVector3d euler = m_euler[i] * (1 - w) + m_euler[i + (w > 0)] * w;
+        ChVector3d euler_error = EulerXYZ(sample.rot) - euler;
+        m_rot_sum += std::fabs(euler_error.x()) + std::fabs(euler_error.y()) + std::fabs(euler_error.z());
+
+        if (m_diff_left.empty()) {
+            m_residuals.diff_residual = std::nan("");
+        } else {
+            double left = m_diff_left[i] * (1 - w) + m_diff_left[i + (w > 0)] * w;
+            double right = m_diff_right[i] * (1 - w) + m_diff_right[i + (w > 0)] * w;
+            m_residuals.diff_residual += 10 * ((sample.bogie_left - left) * (sample.bogie_left - left) +
+                                               (sample.bogie_right - right) * (sample.bogie_right - right));
+        }
+
+        m_residuals.slip_residual = m_slip_sum / m_residuals.samples;
+        m_residuals.rot_residual = m_rot_sum / (3 * m_residuals.samples);
+        m_residuals.combined = 10 * m_residuals.slip_residual + m_residuals.residual;
+    }
+
+    const Residuals& GetResiduals() const {
+        return m_residuals;
+    }
+
+    /*
+        Intrinsic XYZ Euler angles [deg] of q, as scipy's as_euler("XYZ", degrees=True)
+    */
+    static ChVector3d EulerXYZ(ChQuaterniond q) {
+        q.Normalize();
+        double w = q.e0(), x = q.e1(), y = q.e2(), z = q.e3();
+        double r00 = 1 - 2 * (y * y + z * z);
+        double r01 = 2 * (x * y - w * z);
+        double r02 = 2 * (x * z + w * y);
+        double r12 = 2 * (y * z - w * x);
+        double r22 = 1 - 2 * (x * x + y * y);
+        double deg = 180.0 / CH_PI;
+        return ChVector3d(std::atan2(-r12, r22), std::asin(std::clamp(r02, -1.0, 1.0)), std::atan2(-r01, r00)) * deg;
+    }
+
+private:
+
+    /*
+        Index i and weight w of t between rows i and i + 1, clamped to the first and last rows
+    */
+    void Bracket(double t, size_t& i, double& w) const {
+        if (t <= m_time.front() || m_time.size() == 1) {
+            i = 0;
+            w = 0;
+            return;
+        }
+        if (t >= m_time.back()) {
+            i = m_time.size() - 1;
+            w = 0;
+            return;
+        }
+        i = std::upper_bound(m_time.begin(), m_time.end(), t) - m_time.begin() - 1;
+        w = (t - m_time[i]) / (m_time[i + 1] - m_time[i]);
+    }
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef PERSEVERENCE_SINKAGE_H
+#define PERSEVERENCE_SINKAGE_H
+
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "chrono_vehicle/terrain/CRMTerrain.h"
+#include "heightmap_parser.h"
+
+using namespace chrono;
+using namespace chrono::vehicle;
+
+/*
+    Per-wheel sinkage and rut depth, site frame (z down), both positive into the ground
+
+    Sinkage is how far the bottom of each wheel sits below the baked DEM under its hub. Rut depth is how
+    far the soil surface just behind the wheel (the top SPH particle in a small box trailing the contact
+    patch) sits below the DEM there. Only the particles in those boxes are queried, never the whole domain.
+*/
+class PerseveranceSinkage {
+private:
+    std::vector<std::shared_ptr<ChBody>> m_wheels;
+    std::shared_ptr<ChBody> m_chassis;
+    const HeightmapParser::HeightGrid* m_dem = nullptr;
+
+    double m_radius = 0.2625;     // [m] wheel radius
+    double m_width = 0.25;        // [m] rut box width across the wheel
+    double m_rut_length = 0.1;    // [m] rut box length along the heading
+
+    std::vector<double> m_sinkage;
+    std::vector<double> m_rut;
+
+public:
+
+    /*
+        Wheels in RoverDefinition order; dem must outlive the monitor
+    */
+    void Initialize(const std::vector<std::shared_ptr<ChBody>>& wheels, std::shared_ptr<ChBody> chassis, const HeightmapParser::HeightGrid* dem) {
+        m_wheels = wheels;
+        m_chassis = chassis;
+        m_dem = dem;
+        m_sinkage.assign(wheels.size(), std::nan(""));
+        m_rut.assign(wheels.size(), std::nan(""));
+    }
+
+    void SetWheelGeometry(double radius, double width) {
+        m_radius = radius;
+        m_width = width;
+    }
+
+    /*
+        Refresh the metrics, rut depths stay NaN without a CRM terrain or when no particle is behind a wheel
+    */
+    void Update(CRMTerrain* terrain) {
+        ChVector3d forward = m_chassis->GetRot().GetAxisX();
+        double norm = std::sqrt(forward.x() * forward.x() + forward.y() * forward.y());
+        double yaw = std::atan2(forward.y(), forward.x());
+        ChQuaterniond heading = QuatFromAngleZ(yaw);
+
+        for (size_t i = 0; i < m_wheels.size(); i++) {
+            ChVector3d hub = m_wheels[i]->GetFrameRefToAbs().GetPos();
+            m_sinkage[i] = hub.z() + m_radius - HeightmapParser::HeightAt(*m_dem, hub.x(), hub.y());
+
+            m_rut[i] = std::nan("");
+            if (!terrain || norm < 1e-6) {
+                continue;
+            }
+
+            // Trail the contact patch, whichever way the wheel is rolling
+            ChVector3d vel = m_wheels[i]->GetPosDt();
+            double dir = vel.x() * forward.x() + vel.y() * forward.y() < 0 ? 1.0 : -1.0;
+            double offset = m_radius + 0.5 * m_rut_length;
+            ChVector3d center(hub.x() + dir * offset * forward.x() / norm, hub.y() + dir * offset * forward.y() / norm, hub.z() + m_radius);
+
+            ChVector3d size(m_rut_length, m_width, 2 * m_radius);
+            auto& sysSPH = terrain->GetFluidSystemSPH();
+            auto indices = sysSPH.FindParticlesInBox(ChFrame<>(center, heading), size);
+            if (indices.empty()) {
+                continue;
+            }
+
+            double top = std::numeric_limits<double>::infinity();
+            for (const auto& p : sysSPH.GetPositions(indices)) {
+                top = std::min(top, p.z());
+            }
+            m_rut[i] = top - HeightmapParser::HeightAt(*m_dem, center.x(), center.y());
+        }
+    }
+
+    /*
+        Log channel names, <wheel>_sink then <wheel>_rut in RoverDefinition wheel order
+    */
+    static std::vector<std::string> GetChannelNames() {
+        std::vector<std::string> names;
+        for (const char* metric : { "sink", "rut" }) {
+            for (const char* wheel : { "wrf", "wrc", "wrb", "wlf", "wlc", "wlb" }) {
+                names.push_back(std::string(wheel) + "_" + metric);
+            }
+        }
+        return names;
+    }
+
+    void GetChannels(std::vector<double>& values) const {
+        values.clear();
+        values.insert(values.end(), m_sinkage.begin(), m_sinkage.end());
+        values.insert(values.end(), m_rut.begin(), m_rut.end());
+    }
+
+    const std::vector<double>& GetSinkage() const {
+        return m_sinkage;
+    }
+
+    const std::vector<double>& GetRutDepth() const {
+        return m_rut;
+    }
+};
+
+#endif
@@ -6,6 +6,14 @@
 #include "chrono/physics/ChSystemSMC.h"
 #include "chrono/physics/ChLinkLockGear.h"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
 using namespace chrono::parsers;
 
 using namespace chrono;
@@ -25,6 +33,25 @@ public:
         std::vector<std::shared_ptr<ChLinkBase>> steer_joints;
         std::shared_ptr<ChBody> chassis;
         ChFrame<> init_pose;
+        std::vector<std::shared_ptr<ChBody>> bodies; // every body of the rover model
+    };
+
+    struct ConformParameters {
+        double wheel_radius = 0.2625; // [m]
+        double clearance = 0.0;       // [m] gap left under the lowest wheel
+        double max_angle = 0.6;       // [rad] rocker and bogie travel
+        int iterations = 20;
+    };
+
+    /*
+        Suspension state that puts the wheels on the terrain, angles about the joint axes
+    */
+    struct ConformResult {
+        double dz = 0.0;           // [m] chassis shift along site z (down)
+        double rocker = 0.0;       // [rad] left differential, the right one turns the other way
+        double bogie_left = 0.0;   // [rad]
+        double bogie_right = 0.0;  // [rad]
+        std::array<double, 6> clearance {}; // [m] per wheel, in RoverDefinition::wheels order
     };
 
     /*
@@ -43,6 +70,7 @@ public:
 
     static RoverDefinition InitializeRover(std::string filename, ChFrame<> pose, ChSystem& sys, double z_off, bool position_based_control, bool verbose=true, bool fixed = false) {
         ChParserURDF parser(GetChronoDataFile(filename));
+        size_t first_body = sys.GetBodies().size();
         
         InitializeArmJoints(parser);
         // Setup control modes for actuated joints
@@ -111,7 +139,9 @@ public:
         SetArmJointIncons(parser);
         InitializeDiffBar(sys,parser);
 
-        return { parser, wheels, steers, steer_joints, parser.GetRootChBody(), pose };
+        std::vector<std::shared_ptr<ChBody>> bodies(sys.GetBodies().begin() + first_body, sys.GetBodies().end());
+
+        return { parser, wheels, steers, steer_joints, parser.GetRootChBody(), pose, bodies };
     }
     static void InitializeJointControl(ChParserURDF& parser, bool position_based = false) {
 
@@ -229,6 +259,346 @@ public:
         return ChFrame<>(ChVector3d(0,0,0), ChQuaterniond(1,0,0,0));
     }
 
+    /*
+        Kinematic conformance of the rover to the terrain, replacing most of the settle phase
+
+        The chassis keeps its telemetry attitude. Its height along z, the differential (left and right
+        rockers turn opposite ways) and both bogie angles are solved by Gauss-Newton so all six wheels just
+        touch the surface given by height(x, y) (site frame, z down). The rover is then lifted so the lowest
+        wheel sits clearance above the ground, and every body is moved to the solved configuration, which
+        keeps all joints assembled. Call after the bodies are populated and before the first step.
+    */
+    static ConformResult ConformRoverIncons(RoverDefinition& def, const std::function<double(double, double)>& height, const ConformParameters& params) {
+        struct Pivot {
+            ChVector3d pos;
+            ChVector3d axis;
+        };
+        auto pivot = [&](const std::string& joint) {
+            auto link = std::dynamic_pointer_cast<ChLinkLock>(def.parser.GetChLink(joint));
+            if (!link) {
+                throw std::runtime_error("Conformance: no revolute joint " + joint);
+            }
+            return Pivot { link->GetFrame2Abs().GetPos(), link->GetFrame2Abs().GetRot().GetAxisZ() };
+        };
+
+        // Left side first, then right: rocker pivot, bogie pivot
+        Pivot rockers[2] = { pivot("LEFT_DIFFERENTIAL"), pivot("RIGHT_DIFFERENTIAL") };
+        Pivot bogies[2] = { pivot("LEFT_BOGIE"), pivot("RIGHT_BOGIE") };
+
+        // Bodies carried by each joint; the front wheel rides on the rocker, middle and rear on the bogie
+        const char* sides[2] = { "Left", "Right" };
+        std::vector<std::shared_ptr<ChBody>> rocker_bodies[2];
+        std::vector<std::shared_ptr<ChBody>> bogie_bodies[2];
+        for (int s = 0; s < 2; s++) {
+            std::string side = sides[s];
+            for (const auto& name : { "Body_Rocker" + side, "Body_Steer" + side + "Front", "Body_Wheel" + side + "Front" }) {
+                rocker_bodies[s].push_back(def.parser.GetChBody(name));
+            }
+            for (const auto& name : { "Body_Bogie" + side, "Body_Wheel" + side + "Middle", "Body_Steer" + side + "Rear", "Body_Wheel" + side + "Rear" }) {
+                bogie_bodies[s].push_back(def.parser.GetChBody(name));
+            }
+        }
+
+        // Wheel i: side, and whether it rides on the bogie
+        int wheel_side[6];
+        bool wheel_on_bogie[6];
+        std::vector<ChVector3d> centers(6);
+        for (int i = 0; i < 6; i++) {
+            wheel_side[i] = -1;
+            for (int s = 0; s < 2; s++) {
+                for (const auto& b : rocker_bodies[s]) {
+                    if (b == def.wheels[i]) {
+                        wheel_side[i] = s;
+                        wheel_on_bogie[i] = false;
+                    }
+                }
+                for (const auto& b : bogie_bodies[s]) {
+                    if (b == def.wheels[i]) {
+                        wheel_side[i] = s;
+                        wheel_on_bogie[i] = true;
+                    }
+                }
+            }
+            if (wheel_side[i] < 0) {
+                throw std::runtime_error("Conformance: wheel " + std::to_string(i) + " not found on a rocker or bogie");
+            }
+            centers[i] = def.wheels[i]->GetFrameRefToAbs().GetPos();
+        }
+
+        auto rotate = [](const Pivot& p, double angle, const ChVector3d& v) {
+            return p.pos + QuatFromAngleAxis(angle, p.axis).Rotate(v - p.pos);
+        };
+
+        // q = (dz, rocker, bogie left, bogie right)
+        auto wheel_center = [&](const double* q, int i) {
+            int s = wheel_side[i];
+            ChVector3d c = centers[i];
+            if (wheel_on_bogie[i]) {
+                c = rotate(bogies[s], q[2 + s], c);
+            }
+            c = rotate(rockers[s], s == 0 ? q[1] : -q[1], c);
+            return c + ChVector3d(0, 0, q[0]);
+        };
+
+        // Gap between the wheel and the ground along the local surface normal
+        auto clearance = [&](const double* q, int i) {
+            ChVector3d c = wheel_center(q, i);
+            const double h = 0.05;
+            double gx = (height(c.x() + h, c.y()) - height(c.x() - h, c.y())) / (2 * h);
+            double gy = (height(c.x(), c.y() + h) - height(c.x(), c.y() - h)) / (2 * h);
+            return (height(c.x(), c.y()) - c.z()) / std::sqrt(1 + gx * gx + gy * gy) - params.wheel_radius;
+        };
+
+        double q[4] = { 0, 0, 0, 0 };
+        for (int it = 0; it < params.iterations; it++) {
+            double r[6];
+            double J[6][4];
+            for (int i = 0; i < 6; i++) {
+                r[i] = clearance(q, i);
+            }
+            for (int k = 0; k < 4; k++) {
+                const double eps = 1e-4;
+                double qk[4] = { q[0], q[1], q[2], q[3] };
+                qk[k] += eps;
+                for (int i = 0; i < 6; i++) {
+                    J[i][k] = (clearance(qk, i) - r[i]) / eps;
+                }
+            }
+
+            // Normal equations (J^T J) dq = -J^T r, tiny damping keeps them regular
+            double A[4][5] = {};
+            for (int a = 0; a < 4; a++) {
+                for (int b = 0; b < 4; b++) {
+                    for (int i = 0; i < 6; i++) {
+                        A[a][b] += J[i][a] * J[i][b];
+                    }
+                }
+                A[a][a] += 1e-9;
+                for (int i = 0; i < 6; i++) {
+                    A[a][4] -= J[i][a] * r[i];
+                }
+            }
+            for (int c = 0; c < 4; c++) {
+                int best = c;
+                for (int a = c + 1; a < 4; a++) {
+                    if (std::fabs(A[a][c]) > std::fabs(A[best][c])) {
+                        best = a;
+                    }
+                }
+                std::swap(A[c], A[best]);
+                for (int a = 0; a < 4; a++) {
+                    if (a != c) {
+                        double f = A[a][c] / A[c][c];
+                        for (int b = c; b < 5; b++) {
+                            A[a][b] -= f * A[c][b];
+                        }
+                    }
+                }
+            }
+
+            double step = 0;
+            for (int k = 0; k < 4; k++) {
+                double dq = A[k][4] / A[k][k];
+                q[k] += dq;
+                step = std::max(step, std::fabs(dq));
+            }
+            for (int k = 1; k < 4; k++) {
+                q[k] = std::clamp(q[k], -params.max_angle, params.max_angle);
+            }
+            if (step < 1e-6) {
+                break;
+            }
+        }
+
+        // Lift (or drop) the rover so no wheel ends up in the ground
+        for (int pass = 0; pass < 2; pass++) {
+            double lowest = std::numeric_limits<double>::infinity();
+            for (int i = 0; i < 6; i++) {
+                lowest = std::min(lowest, clearance(q, i));
+            }
+            q[0] += lowest - params.clearance;
+        }
+
+        // Move every body to the solved configuration, bogie first while its pivot is still in place
+        auto move = [&](const std::shared_ptr<ChBody>& body, const Pivot& p, double angle) {
+            ChQuaterniond rot = QuatFromAngleAxis(angle, p.axis);
+            const ChFrame<>& frame = body->GetFrameCOMToAbs();
+            body->SetPos(p.pos + rot.Rotate(frame.GetPos() - p.pos));
+            body->SetRot(rot * frame.GetRot());
+        };
+        for (int s = 0; s < 2; s++) {
+            for (const auto& b : bogie_bodies[s]) {
+                move(b, bogies[s], q[2 + s]);
+            }
+            for (const auto& b : bogie_bodies[s]) {
+                move(b, rockers[s], s == 0 ? q[1] : -q[1]);
+            }
+            for (const auto& b : rocker_bodies[s]) {
+                move(b, rockers[s], s == 0 ? q[1] : -q[1]);
+            }
+        }
+        for (const auto& b : def.bodies) {
+            b->SetPos(b->GetFrameCOMToAbs().GetPos() + ChVector3d(0, 0, q[0]));
+            b->SetPosDt(VNULL);
+            b->SetAngVelParent(VNULL);
+        }
+
+        ConformResult result;
+        result.dz = q[0];
+        result.rocker = q[1];
+        result.bogie_left = q[2];
+        result.bogie_right = q[3];
+        for (int i = 0; i < 6; i++) {
+            result.clearance[i] = clearance(q, i);
+        }
+        def.init_pose.SetPos(def.init_pose.GetPos() + ChVector3d(0, 0, q[0]));
+
+        std::cout << "Conformed rover to terrain: dz " << result.dz << ", rocker " << result.rocker << ", bogies "
+                  << result.bogie_left << " / " << result.bogie_right << ", wheel clearance";
+        for (double c : result.clearance) {
+            std::cout << " " << c;
+        }
+        std::cout << std::endl;
+        return result;
+    }
+
+    /*
+        Index of the named column in a CSV header line, -1 when absent
+    */
+    static int CsvColumn(const std::string& header, const std::string& name) {
+        std::istringstream ss(header);
+        int i = 0;
+        for (std::string token; std::getline(ss, token, ','); i++) {
+            token.erase(0, token.find_first_not_of(" \r"));
+            token.erase(token.find_last_not_of(" \r") + 1);
+            if (token == name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    /*
+        Numeric fields of a CSV line, NaN for empty or non-numeric ones
+    */
+    static std::vector<double> CsvTokens(const std::string& line) {
+        std::istringstream ss(line);
+        std::vector<double> tokens;
+        for (std::string token; std::getline(ss, token, ',');) {
+            try {
+                tokens.push_back(std::stod(token));
+            } catch (const std::exception&) {
+                tokens.push_back(std::nan(""));
+            }
+        }
+        return tokens;
+    }
+
+    /*
+        Planar rover path (ROVER_X, ROVER_Y) over SCLK in [t_init, t_init + t_fin], points closer than min_step dropped
+        The rows bracketing the window are kept too, so the path covers the start and end poses
+    */
+    static std::vector<ChVector2d> ReadTrajectory(std::string csv, double t_init, double t_fin, double min_step) {
+        std::ifstream inputFile(csv);
+
+        if (!inputFile.is_open()) {
+            throw std::runtime_error("Error opening input CSV");
+        }
+
+        std::string header;
+        std::getline(inputFile, header);
+        int sclk = CsvColumn(header, "SCLK");
+        int x = CsvColumn(header, "ROVER_X [METERS]");
+        int y = CsvColumn(header, "ROVER_Y [METERS]");
+        if (sclk < 0 || x < 0 || y < 0) {
+            throw std::runtime_error("Trajectory CSV " + csv + " lacks SCLK or ROVER_X/Y [METERS]");
+        }
+
+        std::vector<ChVector2d> path;
+        auto add = [&](const ChVector2d& p) {
+            if (path.empty() || (p - path.back()).Length() >= min_step) {
+                path.push_back(p);
+            }
+        };
+
+        bool before = false;
+        ChVector2d start;
+        for (std::string line; std::getline(inputFile, line);) {
+            std::vector<double> tokens = CsvTokens(line);
+            if ((int)tokens.size() <= std::max({ sclk, x, y }) || std::isnan(tokens[sclk] + tokens[x] + tokens[y])) {
+                continue;
+            }
+
+            ChVector2d p(tokens[x], tokens[y]);
+            if (tokens[sclk] <= t_init) {
+                before = true;
+                start = p;
+                continue;
+            }
+            if (before) {
+                add(start);
+                before = false;
+            }
+            add(p);
+            if (tokens[sclk] >= t_init + t_fin) {
+                break;
+            }
+        }
+        if (before) {
+            add(start);
+        }
+        return path;
+    }
+
+    /*
+        Largest commanded wheel rate [rad/s] in an open-loop command CSV over SCLK in [t_init, t_init + t_fin]
+        The commands bracketing the window count too, the controller interpolates towards them
+    */
+    static double MaxWheelRate(std::string csv, double t_init, double t_fin) {
+        std::ifstream inputFile(csv);
+
+        if (!inputFile.is_open()) {
+            throw std::runtime_error("Error opening input CSV");
+        }
+
+        std::string header;
+        std::getline(inputFile, header);
+        int sclk = CsvColumn(header, "SCLK");
+        std::vector<int> drives;
+        for (const char* name : { "LF_DRIVE", "LM_DRIVE", "LR_DRIVE", "RF_DRIVE", "RM_DRIVE", "RR_DRIVE" }) {
+            drives.push_back(CsvColumn(header, name));
+        }
+        if (sclk < 0 || *std::min_element(drives.begin(), drives.end()) < 0) {
+            throw std::runtime_error("Command CSV " + csv + " lacks SCLK or LF/LM/LR/RF/RM/RR_DRIVE");
+        }
+        int last = std::max(sclk, *std::max_element(drives.begin(), drives.end()));
+
+        double rate = 0.0;
+        double before = 0.0; // rate of the last command at or before t_init
+        for (std::string line; std::getline(inputFile, line);) {
+            std::vector<double> tokens = CsvTokens(line);
+            if ((int)tokens.size() <= last || std::isnan(tokens[sclk])) {
+                continue;
+            }
+
+            double row = 0.0;
+            for (int i : drives) {
+                if (!std::isnan(tokens[i])) {
+                    row = std::max(row, std::fabs(tokens[i]));
+                }
+            }
+            if (tokens[sclk] <= t_init) {
+                before = row;
+                continue;
+            }
+            rate = std::max(rate, row);
+            if (tokens[sclk] >= t_init + t_fin) {
+                break;
+            }
+        }
+        return std::max(rate, before);
+    }
+
     static void InitializeDiffBar(ChSystem& sys, ChParserURDF& parser)  {
         std::shared_ptr<ChLinkBase> ldiff = parser.GetChLink("LEFT_DIFFERENTIAL");
         std::shared_ptr<ChLinkBase> rdiff = parser.GetChLink("RIGHT_DIFFERENTIAL");
@@ -0,0 +1,189 @@
+#ifndef PNG_STREAM_H
+#define PNG_STREAM_H
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+    16-bit grayscale PNG written row by row with bounded memory (no Chrono dependencies)
+
+    Rows go straight to disk as stored (uncompressed) deflate blocks, so only the rows handed to
+    WriteRows are ever held. The output is plain PNG readable by any decoder.
+*/
+class PngStream16 {
+private:
+    std::ofstream m_out;
+    int m_width = 0;
+    int m_height = 0;
+    int m_rows = 0;
+
+    uint32_t m_adler_a = 1;
+    uint32_t m_adler_b = 0;
+
+    std::vector<uint8_t> m_pending; // filtered scanlines not yet flushed to a deflate block
+    bool m_started = false;
+    bool m_closed = false;
+
+    static constexpr size_t kMaxStoredBlock = 65535;
+
+    static const uint32_t* CrcTable() {
+        static uint32_t table[256];
+        static bool init = false;
+        if (!init) {
+            for (uint32_t n = 0; n < 256; n++) {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++) {
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                table[n] = c;
+            }
+            init = true;
+        }
+        return table;
+    }
+
+    static uint32_t Crc(const uint8_t* data, size_t size, uint32_t crc = 0xFFFFFFFFu) {
+        const uint32_t* table = CrcTable();
+        for (size_t i = 0; i < size; i++) {
+            crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+    static void Put32(std::vector<uint8_t>& buf, uint32_t v) {
+        buf.push_back(v >> 24);
+        buf.push_back(v >> 16);
+        buf.push_back(v >> 8);
+        buf.push_back(v);
+    }
+
+    void WriteChunk(const char* type, const std::vector<uint8_t>& data) {
+        std::vector<uint8_t> head;
+        Put32(head, data.size());
+        m_out.write(reinterpret_cast<const char*>(head.data()), 4);
+
+        uint32_t crc = Crc(reinterpret_cast<const uint8_t*>(type), 4);
+        crc = Crc(data.data(), data.size(), crc);
+        m_out.write(type, 4);
+        m_out.write(reinterpret_cast<const char*>(data.data()), data.size());
+
+        std::vector<uint8_t> tail;
+        Put32(tail, crc ^ 0xFFFFFFFFu);
+        m_out.write(reinterpret_cast<const char*>(tail.data()), 4);
+    }
+
+    /*
+        Emit the pending scanlines as stored deflate blocks in one IDAT chunk
+        The first chunk opens the zlib stream, the final one closes it with the Adler-32
+    */
+    void FlushRows(bool final) {
+        std::vector<uint8_t> idat;
+        if (!m_started) {
+            // zlib header: deflate, 32K window, no preset dictionary, lowest level
+            idat.push_back(0x78);
+            idat.push_back(0x01);
+            m_started = true;
+        }
+
+        size_t pos = 0;
+        do {
+            size_t len = std::min(kMaxStoredBlock, m_pending.size() - pos);
+            bool last = final && pos + len == m_pending.size();
+            idat.push_back(last ? 1 : 0);
+            idat.push_back(len & 0xFF);
+            idat.push_back((len >> 8) & 0xFF);
+            idat.push_back(~len & 0xFF);
+            idat.push_back((~len >> 8) & 0xFF);
+            idat.insert(idat.end(), m_pending.begin() + pos, m_pending.begin() + pos + len);
+            pos += len;
+        } while (pos < m_pending.size());
+
+        if (final) {
+            Put32(idat, (m_adler_b << 16) | m_adler_a);
+        }
+        WriteChunk("IDAT", idat);
+        m_pending.clear();
+    }
+
+public:
+
+    PngStream16(const std::string& filename, int width, int height)
+        : m_out(filename, std::ios::binary | std::ios::trunc), m_width(width), m_height(height) {
+        if (!m_out.is_open()) {
+            throw std::runtime_error("[PNG] Error opening " + filename);
+        }
+
+        static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+        m_out.write(reinterpret_cast<const char*>(signature), 8);
+
+        std::vector<uint8_t> ihdr;
+        Put32(ihdr, width);
+        Put32(ihdr, height);
+        ihdr.push_back(16); // bit depth
+        ihdr.push_back(0);  // grayscale
+        ihdr.push_back(0);  // deflate
+        ihdr.push_back(0);  // adaptive filtering
+        ihdr.push_back(0);  // no interlace
+        WriteChunk("IHDR", ihdr);
+    }
+
+    ~PngStream16() {
+        if (!m_closed && m_out.is_open()) {
+            try {
+                Close();
+            } catch (...) {
+            }
+        }
+    }
+
+    /*
+        Append count rows of width samples each, top row first
+    */
+    void WriteRows(const uint16_t* samples, int count) {
+        if (m_rows + count > m_height) {
+            throw std::runtime_error("[PNG] More rows than the image height");
+        }
+
+        size_t row_bytes = 1 + 2 * (size_t)m_width;
+        size_t start = m_pending.size();
+        m_pending.resize(start + count * row_bytes);
+
+        for (int r = 0; r < count; r++) {
+            uint8_t* dst = m_pending.data() + start + r * row_bytes;
+            const uint16_t* src = samples + (size_t)r * m_width;
+            dst[0] = 0; // filter: none
+            for (int i = 0; i < m_width; i++) {
+                dst[1 + 2 * i] = src[i] >> 8;
+                dst[2 + 2 * i] = src[i] & 0xFF;
+            }
+            for (size_t i = 0; i < row_bytes; i++) {
+                m_adler_a = (m_adler_a + dst[i]) % 65521;
+                m_adler_b = (m_adler_b + m_adler_a) % 65521;
+            }
+        }
+        m_rows += count;
+
+        if (m_pending.size() >= kMaxStoredBlock) {
+            FlushRows(false);
+        }
+    }
+
+    void Close() {
+        if (m_closed) {
+            return;
+        }
+        if (m_rows != m_height) {
+            throw std::runtime_error("[PNG] Closed after " + std::to_string(m_rows) + " of " + std::to_string(m_height) + " rows");
+        }
+        FlushRows(true);
+        WriteChunk("IEND", std::vector<uint8_t>());
+        m_out.close();
+        m_closed = true;
+    }
+};
+
+#endif
@@ -0,0 +1,255 @@
+#ifndef SETTLE_CHECKPOINT_H
+#define SETTLE_CHECKPOINT_H
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "chrono/physics/ChBody.h"
+#include "cache_utils.h"
+
+using namespace chrono;
+
+/*
+    Terrain and rover state at the end of the settle phase, cached per terrain, soil and settle settings
+
+    Trials that share the DEM, spacing, soil parameters and initial pose settle to the same state, so the
+    first one stores it and later ones start the drive from it. Particles keep position, velocity,
+    density/pressure/viscosity and the deviatoric stress (GetParticleStress* from chrono.patch); bodies keep
+    pose and velocities. The file format and key only depend on Chrono core types.
+*/
+class SettleCheckpoint {
+
+public:
+
+    struct BodyState {
+        ChVector3d pos;
+        ChQuaterniond rot;
+        ChVector3d pos_dt;
+        ChVector3d ang_vel; // local frame
+    };
+
+    struct State {
+        double time = 0;                     // [s] simulation time the drive resumes from
+        std::vector<ChVector3d> positions;
+        std::vector<ChVector3d> velocities;
+        std::vector<ChVector3d> properties;  // density, pressure, viscosity
+        std::vector<ChVector3d> stress_diag; // deviatoric stress xx, yy, zz
+        std::vector<ChVector3d> stress_off;  // deviatoric stress xy, xz, yz
+        std::vector<BodyState> bodies;       // RoverDefinition::bodies order
+    };
+
+    struct CheckpointHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t key;
+        double time;
+        uint64_t particles;
+        uint64_t bodies;
+    };
+
+    static constexpr char kCheckpointMagic[8] = { 'C', 'M', 'S', 'E', 'T', 'L', 0, 0 };
+    static constexpr uint32_t kCheckpointVersion = 2;
+    static constexpr size_t kParticleDoubles = 15;
+    static constexpr size_t kBodyDoubles = 13;
+
+    /*
+        settings: everything the settle phase depends on besides the terrain (soil, steps, durations), seeded
+        with the caller's string settings; bodies: initial rover state, before settling
+    */
+    void Initialize(const std::string& cache_dir, uint64_t seed, const std::vector<double>& settings, const std::vector<BodyState>& bodies) {
+        m_cache_dir = cache_dir;
+        m_settings_key = SettingsKey(seed, settings, bodies);
+        m_enabled = !cache_dir.empty();
+    }
+
+    /*
+        Combine with the terrain key and look the state up, once the terrain is known
+        Returns true when a stored state was loaded
+    */
+    bool Resolve(uint64_t terrain_key) {
+        if (!m_enabled) {
+            return false;
+        }
+        m_key = Key(m_settings_key, terrain_key);
+        m_file = Path(m_cache_dir, m_key);
+        m_restored = Load(m_file, m_key, m_state);
+        m_resolved = true;
+        if (m_restored) {
+            std::cout << "Loaded settled state " << m_file << ": " << m_state.positions.size() << " SPH particles at t = "
+                      << m_state.time << std::endl;
+        }
+        return m_restored;
+    }
+
+    /*
+        True when the terrain was resolved without a stored state, so the settled one should be saved
+    */
+    bool IsPending() const {
+        return m_resolved && !m_restored && !m_stored;
+    }
+
+    bool IsRestored() const {
+        return m_restored;
+    }
+
+    const State& GetState() const {
+        return m_state;
+    }
+
+    void Save(const State& state) {
+        m_stored = true;
+        if (Store(m_file, m_key, state)) {
+            std::cout << "Cached settled state " << m_file << std::endl;
+        } else {
+            std::cerr << "Warning: could not write settled state " << m_file << std::endl;
+        }
+    }
+
+    /*
+        Release the particle arrays once they are handed to the terrain
+    */
+    void ReleaseParticles() {
+        std::vector<ChVector3d>().swap(m_state.positions);
+        std::vector<ChVector3d>().swap(m_state.velocities);
+        std::vector<ChVector3d>().swap(m_state.properties);
+        std::vector<ChVector3d>().swap(m_state.stress_diag);
+        std::vector<ChVector3d>().swap(m_state.stress_off);
+    }
+
+    static std::vector<BodyState> CaptureBodies(const std::vector<std::shared_ptr<ChBody>>& bodies) {
+        std::vector<BodyState> states;
+        states.reserve(bodies.size());
+        for (const auto& body : bodies) {
+            states.push_back({ body->GetPos(), body->GetRot(), body->GetPosDt(), body->GetAngVelLocal() });
+        }
+        return states;
+    }
+
+    static void RestoreBodies(const std::vector<std::shared_ptr<ChBody>>& bodies, const std::vector<BodyState>& states) {
+        if (bodies.size() != states.size()) {
+            throw std::runtime_error("[SettleCheckpoint] Body count does not match the rover model");
+        }
+        for (size_t i = 0; i < bodies.size(); i++) {
+            bodies[i]->SetPos(states[i].pos);
+            bodies[i]->SetRot(states[i].rot);
+            bodies[i]->SetPosDt(states[i].pos_dt);
+            bodies[i]->SetAngVelLocal(states[i].ang_vel);
+        }
+    }
+
+    static uint64_t SettingsKey(uint64_t seed, const std::vector<double>& settings, const std::vector<BodyState>& bodies) {
+        uint64_t key = CacheUtils::HashValue(settings.size(), seed);
+        key = CacheUtils::HashBytes(settings.data(), settings.size() * sizeof(double), key);
+        key = CacheUtils::HashValue(bodies.size(), key);
+        for (const auto& b : bodies) {
+            double values[kBodyDoubles];
+            PackBody(b, values);
+            key = CacheUtils::HashBytes(values, sizeof(values), key);
+        }
+        return key;
+    }
+
+    static uint64_t Key(uint64_t settings_key, uint64_t terrain_key) {
+        return CacheUtils::HashValue(terrain_key, CacheUtils::HashValue(kCheckpointVersion, settings_key));
+    }
+
+    static std::string Path(const std::string& cache_dir, uint64_t key) {
+        return cache_dir + "/settle_" + CacheUtils::KeyHex(key) + ".bin";
+    }
+
+    /*
+        Read a stored state, returns false on a miss or a stale/corrupt entry
+    */
+    static bool Load(const std::string& filename, uint64_t key, State& state) {
+        auto file = CacheUtils::MapFile(filename);
+        if (!file || file->size < sizeof(CheckpointHeader)) {
+            return false;
+        }
+
+        CheckpointHeader header;
+        std::memcpy(&header, file->data, sizeof(header));
+        size_t expected = sizeof(header) + (header.particles * kParticleDoubles + header.bodies * kBodyDoubles) * sizeof(double);
+        if (std::memcmp(header.magic, kCheckpointMagic, sizeof(header.magic)) != 0 || header.version != kCheckpointVersion ||
+            header.key != key || file->size != expected) {
+            return false;
+        }
+
+        const double* data = reinterpret_cast<const double*>(file->data + sizeof(header));
+        state.time = header.time;
+        for (auto* field : { &state.positions, &state.velocities, &state.properties, &state.stress_diag, &state.stress_off }) {
+            field->resize(header.particles);
+            for (size_t i = 0; i < header.particles; i++, data += 3) {
+                (*field)[i] = ChVector3d(data[0], data[1], data[2]);
+            }
+        }
+        state.bodies.resize(header.bodies);
+        for (size_t i = 0; i < header.bodies; i++, data += kBodyDoubles) {
+            state.bodies[i] = UnpackBody(data);
+        }
+        return true;
+    }
+
+    static bool Store(const std::string& filename, uint64_t key, const State& state) {
+        size_t count = state.positions.size();
+        if (state.velocities.size() != count || state.properties.size() != count || state.stress_diag.size() != count ||
+            state.stress_off.size() != count) {
+            throw std::runtime_error("[SettleCheckpoint] Particle arrays differ in length");
+        }
+
+        CheckpointHeader header = {};
+        std::memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+        header.version = kCheckpointVersion;
+        header.key = key;
+        header.time = state.time;
+        header.particles = count;
+        header.bodies = state.bodies.size();
+
+        std::vector<double> data;
+        data.reserve(count * kParticleDoubles + state.bodies.size() * kBodyDoubles);
+        for (const auto* field : { &state.positions, &state.velocities, &state.properties, &state.stress_diag, &state.stress_off }) {
+            for (const auto& v : *field) {
+                data.insert(data.end(), { v.x(), v.y(), v.z() });
+            }
+        }
+        for (const auto& b : state.bodies) {
+            double values[kBodyDoubles];
+            PackBody(b, values);
+            data.insert(data.end(), values, values + kBodyDoubles);
+        }
+
+        return CacheUtils::WriteAtomic(filename, [&](std::ofstream& out) {
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(double));
+        });
+    }
+
+private:
+
+    std::string m_cache_dir;
+    uint64_t m_settings_key = 0;
+    uint64_t m_key = 0;
+    std::string m_file;
+    bool m_enabled = false;
+    bool m_resolved = false;
+    bool m_restored = false;
+    bool m_stored = false;
+    State m_state;
+
+    static void PackBody(const BodyState& b, double* values) {
+        const double packed[kBodyDoubles] = { b.pos.x(), b.pos.y(), b.pos.z(), b.rot.e0(), b.rot.e1(), b.rot.e2(), b.rot.e3(),
+                                              b.pos_dt.x(), b.pos_dt.y(), b.pos_dt.z(), b.ang_vel.x(), b.ang_vel.y(), b.ang_vel.z() };
+        std::memcpy(values, packed, sizeof(packed));
+    }
+
+    static BodyState UnpackBody(const double* v) {
+        return { ChVector3d(v[0], v[1], v[2]), ChQuaterniond(v[3], v[4], v[5], v[6]), ChVector3d(v[7], v[8], v[9]),
+                 ChVector3d(v[10], v[11], v[12]) };
+    }
+};
+
+#endif
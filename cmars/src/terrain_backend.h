@@ -0,0 +1,325 @@
+#ifndef TERRAIN_BACKEND_H
+#define TERRAIN_BACKEND_H
+
+#include <memory>
+#include <unistd.h>
+#include <../thirdparty/nlohmann/json.hpp>
+#include "chrono/collision/ChCollisionShapeTriangleMesh.h"
+#include "chrono_vehicle/terrain/CRMTerrain.h"
+#include "chrono_vehicle/terrain/SCMTerrain.h"
+#include "heightmap_parser.h"
+#include "perseverance_utils.h"
+
+using namespace chrono;
+using namespace chrono::vehicle;
+
+/*
+    Terrain model the rover drives on, selected by soil.terrain in the simdef
+
+    CRM   - SPH soil (GPU), see HeightmapParser::InitializeCRMTerrain
+    SCM   - Chrono's CPU soil contact model, seeded with the same baked DEM
+    RIGID - fixed triangle mesh of the baked DEM
+
+    Every backend steps the multibody system in Advance, so controllers, the logger and the slip
+    monitor run unchanged on any of them.
+*/
+class TerrainBackend {
+public:
+
+    /*
+        Bekker/Janosi soil for SCM; cohesion and friction come from SoilParameters
+    */
+    struct SCMParameters {
+        double bekker_kphi = 2e5;  // [Pa/m^n]
+        double bekker_kc = 0;      // [Pa/m^(n-1)]
+        double bekker_n = 1.1;
+        double janosi_shear = 0.01; // [m]
+        double elastic_k = 4e7;     // [Pa/m]
+        double damping_r = 3e4;     // [Pa s/m]
+    };
+
+    /*
+        SCM parameters from the simdef's soil block (soil.scm), defaults for any key it leaves out
+    */
+    static SCMParameters ParseScmParameters(const nlohmann::json& soil) {
+        SCMParameters scm_params;
+        if (soil.contains("scm")) {
+            const auto& scm = soil["scm"];
+            scm_params.bekker_kphi = scm.value("bekker_kphi", scm_params.bekker_kphi);
+            scm_params.bekker_kc = scm.value("bekker_kc", scm_params.bekker_kc);
+            scm_params.bekker_n = scm.value("bekker_n", scm_params.bekker_n);
+            scm_params.janosi_shear = scm.value("janosi_shear", scm_params.janosi_shear);
+            scm_params.elastic_k = scm.value("elastic_k", scm_params.elastic_k);
+            scm_params.damping_r = scm.value("damping_r", scm_params.damping_r);
+        }
+        return scm_params;
+    }
+
+    /*
+        Everything a backend may need; each one reads the parts it uses
+    */
+    struct Settings {
+        ChVector2d size;
+        HeightmapParser::SoilParameters params;
+        std::vector<std::string> mod_files;
+        std::vector<std::string> ht_files;
+        ChVector3d rover_pos;
+        double step_size_cfd = 0;
+        HeightmapParser::DEMParameters dem;
+        HeightmapParser::DomainParameters domain;
+        SCMParameters scm;
+        HeightmapParser::MeshParameters mesh;
+        SettleCheckpoint* checkpoint = nullptr; // settled CRM state to start from or save, may be null
+    };
+
+    virtual ~TerrainBackend() {}
+
+    /*
+        Advance the terrain and the multibody system by step
+    */
+    virtual void Advance(double step) = 0;
+
+    virtual void SetGravitationalAcceleration(const ChVector3d&) {}
+
+    /*
+        The CRM terrain for FSI visualization, nullptr for other backends
+    */
+    virtual CRMTerrain* GetCRMTerrain() { return nullptr; }
+
+    virtual std::string GetName() const = 0;
+
+    const HeightmapParser::HeightGrid& GetBakedDEM() const {
+        return m_baked;
+    }
+
+    /*
+        Backend for "CRM", "SCM" or "RIGID" on the site DEM
+    */
+    static std::unique_ptr<TerrainBackend> Create(const std::string& type, ChSystem& sys, PerseveranceUtils::RoverDefinition def, const Settings& settings);
+
+    /*
+        Backend for "CRM", "SCM" or "RIGID" on a flat size.x() x size.y() patch, size.z() deep, top at pos
+    */
+    static std::unique_ptr<TerrainBackend> CreateFlat(const std::string& type, ChSystem& sys, PerseveranceUtils::RoverDefinition def, const ChVector3d& size,
+                                                      const HeightmapParser::SoilParameters& params, const ChVector3d& pos, double step_size_cfd, const SCMParameters& scm);
+
+protected:
+    ChSystem* m_sys = nullptr;
+    HeightmapParser::HeightGrid m_baked;
+
+    /*
+        SCM and rigid terrain act through contact, so the wheels need their collision meshes
+    */
+    static void EnableWheelCollision(ChSystem& sys, PerseveranceUtils::RoverDefinition& def, double friction) {
+        ChContactMaterialData mat;
+        mat.mu = friction;
+        mat.kn = 2.5e6;
+        auto cmat = mat.CreateMaterial(sys.GetContactMethod());
+
+        auto mesh_r = ChTriangleMeshConnected::CreateFromWavefrontFile(GetChronoDataFile("M2020/meshes/Wheel_Col.obj"), false, true);
+        auto mesh_l = ChTriangleMeshConnected::CreateFromWavefrontFile(GetChronoDataFile("M2020/meshes/Wheel_Col_L.obj"), false, true);
+        if (!mesh_r || !mesh_l) {
+            throw std::runtime_error("[TerrainBackend] Error reading wheel collision meshes");
+        }
+
+        for (int i = 0; i < 6; i++) {
+            auto shape = chrono_types::make_shared<ChCollisionShapeTriangleMesh>(cmat, i < 3 ? mesh_r : mesh_l, false, false, 0.005);
+            def.wheels[i]->AddCollisionShape(shape);
+            def.wheels[i]->EnableCollision(true);
+        }
+    }
+};
+
+/*
+    SPH soil generated from the DEM over the simulation box or corridor
+*/
+class CRMBackend : public TerrainBackend {
+private:
+    std::unique_ptr<CRMTerrain> m_terrain;
+
+public:
+
+    void Initialize(ChSystem& sys, PerseveranceUtils::RoverDefinition def, const Settings& s) {
+        m_sys = &sys;
+        m_terrain = std::make_unique<CRMTerrain>(sys, s.params.spacing);
+        m_terrain->GetFluidSystemSPH().EnableCudaErrorCheck(false);
+        m_baked = HeightmapParser::InitializeCRMTerrain(def, *m_terrain, s.size, s.params, s.mod_files, s.ht_files, s.rover_pos,
+                                                        s.step_size_cfd, s.dem, s.domain, s.checkpoint);
+    }
+
+    void InitializeFlat(ChSystem& sys, PerseveranceUtils::RoverDefinition def, const ChVector3d& size, const HeightmapParser::SoilParameters& params,
+                        const ChVector3d& pos, double step_size_cfd) {
+        m_sys = &sys;
+        m_terrain = std::make_unique<CRMTerrain>(sys, params.spacing);
+        HeightmapParser::InitializeCRMTerrain(def, *m_terrain, size, params, pos, step_size_cfd);
+    }
+
+    void Advance(double step) override {
+        m_terrain->Advance(step);
+    }
+
+    void SetGravitationalAcceleration(const ChVector3d& g) override {
+        CRMTerrain* terrain = GetCRMTerrain();
+        terrain->GetSystemFSI().SetGravitationalAcceleration(g);
+        terrain->SetGravitationalAcceleration(g);
+    }
+
+    CRMTerrain* GetCRMTerrain() override {
+        return m_terrain.get();
+    }
+
+    std::string GetName() const override {
+        return "CRM";
+    }
+};
+
+/*
+    Chrono SCM on the CPU; its frame is flipped about x so its up axis matches the site frame (z down)
+*/
+class SCMBackend : public TerrainBackend {
+private:
+    std::shared_ptr<SCMTerrain> m_terrain;
+
+    void Create(ChSystem& sys, PerseveranceUtils::RoverDefinition& def, const HeightmapParser::SoilParameters& params, const SCMParameters& scm) {
+        m_sys = &sys;
+        m_terrain = chrono_types::make_shared<SCMTerrain>(&sys);
+        m_terrain->SetReferenceFrame(ChCoordsys<>(VNULL, QuatFromAngleX(CH_PI)));
+        m_terrain->SetSoilParameters(scm.bekker_kphi, scm.bekker_kc, scm.bekker_n, params.cohesion,
+                                     std::atan(params.friction) * 180.0 / CH_PI, scm.janosi_shear, scm.elastic_k, scm.damping_r);
+        EnableWheelCollision(sys, def, params.friction);
+    }
+
+public:
+
+    void Initialize(ChSystem& sys, PerseveranceUtils::RoverDefinition def, const Settings& s) {
+        Create(sys, def, s.params, s.scm);
+
+        ChVector2d size = s.size;
+        ChVector3d center = s.rover_pos;
+        m_baked = HeightmapParser::LoadBakedDEM(s.mod_files, s.ht_files, s.params.spacing, size, center, s.dem);
+
+        // SCM reads heights from a mesh in its own frame: (x, y, z) -> (x, -y, -z)
+        auto mesh = HeightmapParser::asChronoMesh(HeightmapParser::ColumnGrid(m_baked, s.params.spacing, size, center), s.mesh);
+        for (auto& v : mesh->GetCoordsVertices()) {
+            v = ChVector3d(v.x(), -v.y(), -v.z());
+        }
+
+        std::string dir = s.dem.cache_dir.empty() ? "." : s.dem.cache_dir;
+        std::string obj = dir + "/scm_terrain." + std::to_string(getpid()) + ".obj";
+        ChTriangleMeshConnected::WriteWavefront(obj, { *mesh });
+        m_terrain->Initialize(obj, s.params.spacing);
+        std::remove(obj.c_str());
+    }
+
+    void InitializeFlat(ChSystem& sys, PerseveranceUtils::RoverDefinition def, const ChVector3d& size, const HeightmapParser::SoilParameters& params,
+                        const ChVector3d& pos, const SCMParameters& scm) {
+        Create(sys, def, params, scm);
+        m_terrain->SetReferenceFrame(ChCoordsys<>(pos, QuatFromAngleX(CH_PI)));
+        m_terrain->Initialize(size.x(), size.y(), params.spacing);
+    }
+
+    void Advance(double step) override {
+        m_sys->DoStepDynamics(step);
+    }
+
+    std::string GetName() const override {
+        return "SCM";
+    }
+};
+
+/*
+    Fixed triangle mesh of the DEM, contact through the multibody collision system
+*/
+class RigidBackend : public TerrainBackend {
+private:
+    std::shared_ptr<ChBody> m_ground;
+
+    void AddGround(ChSystem& sys, std::shared_ptr<ChTriangleMeshConnected> mesh, double friction) {
+        m_sys = &sys;
+
+        ChContactMaterialData mat;
+        mat.mu = friction;
+        mat.kn = 2.5e6;
+        auto cmat = mat.CreateMaterial(sys.GetContactMethod());
+
+        m_ground = chrono_types::make_shared<ChBody>();
+        m_ground->SetFixed(true);
+        m_ground->AddCollisionShape(chrono_types::make_shared<ChCollisionShapeTriangleMesh>(cmat, mesh, true, false, 0.005));
+        m_ground->EnableCollision(true);
+        sys.AddBody(m_ground);
+    }
+
+public:
+
+    void Initialize(ChSystem& sys, PerseveranceUtils::RoverDefinition def, const Settings& s) {
+        m_baked = HeightmapParser::LoadBakedDEM(s.mod_files, s.ht_files, s.params.spacing, s.size, s.rover_pos, s.dem);
+        auto mesh = HeightmapParser::asChronoMesh(HeightmapParser::ColumnGrid(m_baked, s.params.spacing, s.size, s.rover_pos), s.mesh);
+        AddGround(sys, mesh, s.params.friction);
+        EnableWheelCollision(sys, def, s.params.friction);
+    }
+
+    void InitializeFlat(ChSystem& sys, PerseveranceUtils::RoverDefinition def, const ChVector3d& size, const HeightmapParser::SoilParameters& params,
+                        const ChVector3d& pos) {
+        HeightmapParser::HeightGrid flat;
+        flat.nx = 2;
+        flat.ny = 2;
+        flat.x0 = pos.x() - size.x() / 2;
+        flat.y0 = pos.y() - size.y() / 2;
+        flat.spacing = std::max(size.x(), size.y());
+        float* z = new float[4] { (float)pos.z(), (float)pos.z(), (float)pos.z(), (float)pos.z() };
+        flat.z = std::shared_ptr<const float>(z, std::default_delete<const float[]>());
+        flat.z_min = flat.z_max = pos.z();
+
+        AddGround(sys, HeightmapParser::asChronoMesh(flat, HeightmapParser::MeshParameters()), params.friction);
+        EnableWheelCollision(sys, def, params.friction);
+    }
+
+    void Advance(double step) override {
+        m_sys->DoStepDynamics(step);
+    }
+
+    std::string GetName() const override {
+        return "RIGID";
+    }
+};
+
+inline std::unique_ptr<TerrainBackend> TerrainBackend::Create(const std::string& type, ChSystem& sys, PerseveranceUtils::RoverDefinition def, const Settings& settings) {
+    if (type == "CRM") {
+        auto backend = std::make_unique<CRMBackend>();
+        backend->Initialize(sys, def, settings);
+        return backend;
+    }
+    if (type == "SCM") {
+        auto backend = std::make_unique<SCMBackend>();
+        backend->Initialize(sys, def, settings);
+        return backend;
+    }
+    if (type == "RIGID") {
+        auto backend = std::make_unique<RigidBackend>();
+        backend->Initialize(sys, def, settings);
+        return backend;
+    }
+    throw std::runtime_error("[TerrainBackend] Unknown terrain type " + type);
+}
+
+inline std::unique_ptr<TerrainBackend> TerrainBackend::CreateFlat(const std::string& type, ChSystem& sys, PerseveranceUtils::RoverDefinition def, const ChVector3d& size,
+                                                                  const HeightmapParser::SoilParameters& params, const ChVector3d& pos, double step_size_cfd, const SCMParameters& scm) {
+    if (type == "CRM") {
+        auto backend = std::make_unique<CRMBackend>();
+        backend->InitializeFlat(sys, def, size, params, pos, step_size_cfd);
+        return backend;
+    }
+    if (type == "SCM") {
+        auto backend = std::make_unique<SCMBackend>();
+        backend->InitializeFlat(sys, def, size, params, pos, scm);
+        return backend;
+    }
+    if (type == "RIGID") {
+        auto backend = std::make_unique<RigidBackend>();
+        backend->InitializeFlat(sys, def, size, params, pos);
+        return backend;
+    }
+    throw std::runtime_error("[TerrainBackend] Unknown terrain type " + type);
+}
+
+#endif
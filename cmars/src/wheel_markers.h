@@ -0,0 +1,181 @@
+#ifndef WHEEL_MARKERS_H
+#define WHEEL_MARKERS_H
+
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "chrono/geometry/ChTriangleMeshConnected.h"
+#include "chrono_fsi/sph/ChFsiFluidSystemSPH.h"
+#include "cache_utils.h"
+
+using namespace chrono;
+using namespace chrono::fsi;
+using namespace chrono::fsi::sph;
+
+/*
+    Wheel BCE marker clouds, sampled once per mesh and spacing
+
+    Markers are generated from Wheel_Col.obj (right wheels) and Wheel_Col_L.obj (left wheels, offset
+    along y, not a mirror image) and stored as binary files next to each mesh (or in the DEM cache
+    directory when the data directory is not writable), so later runs and trials skip the mesh
+    sampling.
+*/
+class WheelMarkers {
+
+public:
+
+    typedef std::shared_ptr<const std::vector<ChVector3d>> Markers;
+
+    struct MarkerHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved;
+        uint64_t key;
+        uint64_t count;
+    };
+
+    static constexpr char kMarkerMagic[8] = { 'C', 'M', 'B', 'C', 'E', 0, 0, 0 };
+    static constexpr uint32_t kMarkerVersion = 1;
+
+    static constexpr const char* kRightMesh = "M2020/meshes/Wheel_Col.obj";
+    static constexpr const char* kLeftMesh = "M2020/meshes/Wheel_Col_L.obj";
+
+    /*
+        Right (i < 3) and left wheel markers in the wheel body frame
+    */
+    static std::pair<Markers, Markers> Get(ChFsiFluidSystemSPH& sysSPH, double spacing, const std::string& cache_dir) {
+        std::lock_guard<std::mutex> lock(Mutex());
+        return { Cloud(&sysSPH, kRightMesh, spacing, cache_dir), Cloud(&sysSPH, kLeftMesh, spacing, cache_dir) };
+    }
+
+    /*
+        Bring stored markers into memory without sampling the meshes (no FSI system needed), so processes
+        forked afterwards share them; returns false when some are not stored for this spacing
+    */
+    static bool Preload(double spacing, const std::string& cache_dir) {
+        std::lock_guard<std::mutex> lock(Mutex());
+        bool right = Cloud(nullptr, kRightMesh, spacing, cache_dir) != nullptr;
+        bool left = Cloud(nullptr, kLeftMesh, spacing, cache_dir) != nullptr;
+        return right && left;
+    }
+
+private:
+
+    static std::mutex& Mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::map<uint64_t, Markers>& Loaded() {
+        static std::map<uint64_t, Markers> loaded;
+        return loaded;
+    }
+
+    /*
+        Markers of one mesh: in memory, stored, or sampled with sysSPH and stored (null sysSPH: no sampling,
+        returns null when nothing is stored)
+    */
+    static Markers Cloud(ChFsiFluidSystemSPH* sysSPH, const std::string& mesh_name, double spacing, const std::string& cache_dir) {
+        std::string mesh_file = GetChronoDataFile(mesh_name);
+        uint64_t key = MarkerKey(mesh_file, spacing);
+
+        auto& loaded = Loaded();
+        auto it = loaded.find(key);
+        if (it != loaded.end()) {
+            return it->second;
+        }
+
+        std::string beside = BesidePath(mesh_file, key);
+        std::string fallback = FallbackPath(cache_dir, key);
+
+        auto markers = std::make_shared<std::vector<ChVector3d>>();
+        if (LoadMarkers(beside, key, *markers) || (!fallback.empty() && LoadMarkers(fallback, key, *markers))) {
+            std::cout << "Loaded " << markers->size() << " wheel BCE markers of " << mesh_name << std::endl;
+        } else if (!sysSPH) {
+            return nullptr;
+        } else {
+            auto mesh = ChTriangleMeshConnected::CreateFromWavefrontFile(mesh_file, false, true);
+            if (!mesh) {
+                throw std::runtime_error("[WheelMarkers] Error reading " + mesh_file);
+            }
+            *markers = sysSPH->CreatePointsMesh(*mesh);
+
+            if (StoreMarkers(beside, key, *markers)) {
+                std::cout << "Cached wheel BCE markers " << beside << std::endl;
+            } else if (!fallback.empty() && StoreMarkers(fallback, key, *markers)) {
+                std::cout << "Cached wheel BCE markers " << fallback << std::endl;
+            } else {
+                std::cerr << "Warning: could not cache wheel BCE markers of " << mesh_name << std::endl;
+            }
+        }
+
+        loaded[key] = markers;
+        return markers;
+    }
+
+    static std::string BesidePath(const std::string& mesh_file, uint64_t key) {
+        return mesh_file.substr(0, mesh_file.find_last_of('.')) + "_bce_" + CacheUtils::KeyHex(key) + ".bin";
+    }
+
+    static std::string FallbackPath(const std::string& cache_dir, uint64_t key) {
+        return cache_dir.empty() ? "" : cache_dir + "/wheel_bce_" + CacheUtils::KeyHex(key) + ".bin";
+    }
+
+    /*
+        Key: mesh content plus the sampling spacing
+    */
+    static uint64_t MarkerKey(const std::string& mesh_file, double spacing) {
+        uint64_t key = CacheUtils::HashFile(mesh_file);
+        return CacheUtils::HashValue(spacing, key);
+    }
+
+    static bool LoadMarkers(const std::string& filename, uint64_t key, std::vector<ChVector3d>& markers) {
+        auto file = CacheUtils::MapFile(filename);
+        if (!file || file->size < sizeof(MarkerHeader)) {
+            return false;
+        }
+
+        MarkerHeader header;
+        std::memcpy(&header, file->data, sizeof(header));
+        if (std::memcmp(header.magic, kMarkerMagic, sizeof(header.magic)) != 0 || header.version != kMarkerVersion ||
+            header.key != key || file->size != sizeof(header) + header.count * 3 * sizeof(double)) {
+            return false;
+        }
+
+        const double* xyz = reinterpret_cast<const double*>(file->data + sizeof(header));
+        markers.resize(header.count);
+        for (size_t i = 0; i < header.count; i++) {
+            markers[i] = ChVector3d(xyz[3 * i], xyz[3 * i + 1], xyz[3 * i + 2]);
+        }
+        return true;
+    }
+
+    static bool StoreMarkers(const std::string& filename, uint64_t key, const std::vector<ChVector3d>& markers) {
+        MarkerHeader header = {};
+        std::memcpy(header.magic, kMarkerMagic, sizeof(header.magic));
+        header.version = kMarkerVersion;
+        header.key = key;
+        header.count = markers.size();
+
+        std::vector<double> xyz;
+        xyz.reserve(3 * markers.size());
+        for (const auto& p : markers) {
+            xyz.push_back(p.x());
+            xyz.push_back(p.y());
+            xyz.push_back(p.z());
+        }
+
+        return CacheUtils::WriteAtomic(filename, [&](std::ofstream& out) {
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.write(reinterpret_cast<const char*>(xyz.data()), xyz.size() * sizeof(double));
+        });
+    }
+};
+
+#endif
@@ -0,0 +1,144 @@
+// Round trip of the settled-state checkpoint file (Store / Load / Key), CPU only
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "settle_checkpoint.h"
+
+static int failures = 0;
+
+static void Expect(bool condition, const std::string& what) {
+    if (!condition) {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
+
+static bool Equal(const std::vector<ChVector3d>& a, const std::vector<ChVector3d>& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].x() != b[i].x() || a[i].y() != b[i].y() || a[i].z() != b[i].z()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static SettleCheckpoint::State MakeState(size_t particles) {
+    SettleCheckpoint::State state;
+    state.time = 1.25;
+    for (size_t i = 0; i < particles; i++) {
+        double s = i + 1;
+        state.positions.push_back(ChVector3d(s, -s, 0.5 * s));
+        state.velocities.push_back(ChVector3d(0.1 * s, 0.2 * s, -0.3 * s));
+        state.properties.push_back(ChVector3d(1700 + s, 10 * s, 0.01));
+        state.stress_diag.push_back(ChVector3d(-100 * s, -200 * s, -300 * s));
+        state.stress_off.push_back(ChVector3d(1e-3 * s, -2e-3 * s, 3e-3 * s));
+    }
+    state.bodies.push_back({ ChVector3d(1, 2, 3), ChQuaterniond(1, 0, 0, 0), ChVector3d(0.1, 0, 0), ChVector3d(0, 0, 0.2) });
+    state.bodies.push_back({ ChVector3d(-1, 0.5, 0), ChQuaterniond(0, 1, 0, 0), ChVector3d(0, -0.1, 0), ChVector3d(0.3, 0, 0) });
+    return state;
+}
+
+int main() {
+    char dir_template[] = "/tmp/cmars_checkpoint_XXXXXX";
+    const char* dir = mkdtemp(dir_template);
+    if (!dir) {
+        std::cerr << "Could not create a temporary directory" << std::endl;
+        return 1;
+    }
+
+    auto state = MakeState(5);
+    uint64_t settings_key = SettleCheckpoint::SettingsKey(7, { 0.5, 0.1, 1e-4 }, state.bodies);
+    uint64_t key = SettleCheckpoint::Key(settings_key, 42);
+    std::string file = SettleCheckpoint::Path(dir, key);
+
+    // Keys depend on every input
+    Expect(key == SettleCheckpoint::Key(SettleCheckpoint::SettingsKey(7, { 0.5, 0.1, 1e-4 }, state.bodies), 42), "key is deterministic");
+    Expect(key != SettleCheckpoint::Key(settings_key, 43), "key depends on the terrain");
+    Expect(key != SettleCheckpoint::Key(SettleCheckpoint::SettingsKey(8, { 0.5, 0.1, 1e-4 }, state.bodies), 42), "key depends on the seed");
+    Expect(key != SettleCheckpoint::Key(SettleCheckpoint::SettingsKey(7, { 0.5, 0.1, 2e-4 }, state.bodies), 42), "key depends on the settings");
+    auto moved = state.bodies;
+    moved[1].pos.z() += 1e-6;
+    Expect(key != SettleCheckpoint::Key(SettleCheckpoint::SettingsKey(7, { 0.5, 0.1, 1e-4 }, moved), 42), "key depends on the initial bodies");
+
+    // Round trip
+    Expect(SettleCheckpoint::Store(file, key, state), "store");
+    SettleCheckpoint::State loaded;
+    Expect(SettleCheckpoint::Load(file, key, loaded), "load");
+    Expect(loaded.time == state.time, "time round trip");
+    Expect(Equal(loaded.positions, state.positions), "positions round trip");
+    Expect(Equal(loaded.velocities, state.velocities), "velocities round trip");
+    Expect(Equal(loaded.properties, state.properties), "properties round trip");
+    Expect(Equal(loaded.stress_diag, state.stress_diag), "stress diagonal round trip");
+    Expect(Equal(loaded.stress_off, state.stress_off), "stress off-diagonal round trip");
+    Expect(loaded.bodies.size() == state.bodies.size(), "body count round trip");
+    for (size_t i = 0; i < std::min(loaded.bodies.size(), state.bodies.size()); i++) {
+        const auto& a = loaded.bodies[i];
+        const auto& b = state.bodies[i];
+        Expect(Equal({ a.pos, a.pos_dt, a.ang_vel }, { b.pos, b.pos_dt, b.ang_vel }) && a.rot.e0() == b.rot.e0() &&
+                   a.rot.e1() == b.rot.e1() && a.rot.e2() == b.rot.e2() && a.rot.e3() == b.rot.e3(),
+               "body " + std::to_string(i) + " round trip");
+    }
+
+    // Misses: other key, no file, stale version, truncated file
+    SettleCheckpoint::State missed;
+    Expect(!SettleCheckpoint::Load(file, key + 1, missed), "load rejects another key");
+    Expect(!SettleCheckpoint::Load(SettleCheckpoint::Path(dir, key + 1), key + 1, missed), "load misses an absent file");
+
+    {
+        std::fstream f(file, std::ios::in | std::ios::out | std::ios::binary);
+        f.seekp(offsetof(SettleCheckpoint::CheckpointHeader, version));
+        uint32_t version = SettleCheckpoint::kCheckpointVersion - 1;
+        f.write(reinterpret_cast<const char*>(&version), sizeof(version));
+    }
+    Expect(!SettleCheckpoint::Load(file, key, missed), "load rejects an older version");
+
+    Expect(SettleCheckpoint::Store(file, key, state), "store over an existing entry");
+    std::ifstream in(file, std::ios::binary);
+    std::string bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    in.close();
+    {
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        out.write(bytes.data(), bytes.size() - sizeof(double));
+    }
+    Expect(!SettleCheckpoint::Load(file, key, missed), "load rejects a truncated file");
+
+    // Empty particle set (a rover-only state) still round trips
+    auto empty = MakeState(0);
+    Expect(SettleCheckpoint::Store(file, key, empty) && SettleCheckpoint::Load(file, key, loaded) && loaded.positions.empty() &&
+               loaded.stress_off.empty() && loaded.bodies.size() == 2,
+           "empty particle set round trip");
+
+    // Particle arrays must line up
+    auto ragged = MakeState(3);
+    ragged.stress_off.pop_back();
+    bool threw = false;
+    try {
+        SettleCheckpoint::Store(file, key, ragged);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    Expect(threw, "store rejects ragged particle arrays");
+
+    std::remove(file.c_str());
+    rmdir(dir);
+
+    if (failures) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "settle checkpoint round trip passed" << std::endl;
+    return 0;
+}
@@ -17,6 +17,7 @@ import warnings
 from scipy.spatial.transform import Rotation as R
 import matplotlib.pyplot as plt
 import argparse
+import signal
 
 warnings.filterwarnings("ignore", category=UserWarning)
 
@@ -120,11 +121,88 @@ def compute_score(data):
     
     return { "flag": 0, "residual": residual, "slip_residual": slip_residual, "rot_residual": rot_residual, "diff_residual": diff_residual, "combined": combined, "t_end": end}
 
-def objective_closure(data):
+RESULT_MARKER = "@@cmars-result "
+PROGRESS_MARKER = "@@cmars-progress "
+
+def trial_output_file(data, i):
+    """Output CSV of entry i of data['trials'], as named by demo_cmars"""
+    entry = data['trials'][i]
+    if 'trial_output_file' in entry:
+        return entry['trial_output_file']
+    base, ext = os.path.splitext(data['results']['trial_output_file'])
+    return f"{base}_{i}{ext}"
+
+def trial_data(data, i):
+    """Simdef of entry i of data['trials'], as run by demo_cmars"""
+    trial = json.loads(json.dumps(data))
+    trial.pop('trials')
+    trial['downlink']['sim_input_dir'] = data['trials'][i]['sim_input_dirs']
+    trial['downlink']['control_input_dir'] = data['trials'][i]['control_input_dirs']
+    trial['incon'] = data['trials'][i]['incons']
+    trial['results']['trial_output_file'] = trial_output_file(data, i)
+    return trial
+
+def read_records(stream, count, verbose, on_progress=None):
+    """Collect count result records from demo_cmars output, echoing the log when verbose
+    on_progress(i, progress) gets the running residuals of trial i as they are streamed"""
+    records = []
+    for line in stream:
+        if line.startswith(RESULT_MARKER):
+            records.append(json.loads(line[len(RESULT_MARKER):]))
+            if len(records) == count:
+                break
+        elif line.startswith(PROGRESS_MARKER):
+            if on_progress is not None:
+                on_progress(len(records), json.loads(line[len(PROGRESS_MARKER):]))
+        elif verbose:
+            print(line, end="")
+    return records
+
+def run_trials(data, count, on_progress=None):
+    """Run every entry of data['trials'] in one demo_cmars process, one record per entry"""
+    cmd = ["demo_cmars", json.dumps(data)]
+    if(data['render']):
+        cmd.append("-r")
+
+    result = subprocess.Popen(cmd, stdout=subprocess.PIPE, text=True, bufsize=1)
+    records = read_records(result.stdout, count, data['verbose'], on_progress)
+    for line in result.stdout:
+        if data['verbose']:
+            print(line, end="")
+    result.wait()
+
+    # A crash of demo_cmars itself leaves the remaining trials without a record
+    records += [ { 'status': result.returncode or -1 } ] * (count - len(records))
+    return records
+
+class SimWorker:
+    """demo_cmars kept alive in --worker mode, one simdef per run() and one result record per trial back"""
+
+    def __init__(self, render=False, verbose=False):
+        cmd = ["demo_cmars", "--worker"]
+        if render:
+            cmd.append("-r")
+        self.verbose = verbose
+        self.proc = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE, text=True, bufsize=1)
+
+    def run(self, data, count, on_progress=None):
+        self.proc.stdin.write(json.dumps(data) + "\n")
+        self.proc.stdin.flush()
+        # Trial logs share the worker's stdout, records are the marked lines
+        records = read_records(self.proc.stdout, count, self.verbose, on_progress)
+        if len(records) < count:
+            raise RuntimeError(f"demo_cmars worker exited (code {self.proc.wait()})")
+        return records
+
+    def close(self):
+        if self.proc.poll() is None:
+            self.proc.stdin.close()
+            self.proc.wait()
+
+def objective_closure(data, worker=None):
     def objective(trial):
         
         soil_cfg = data['soil']
-        sim_output_dir = data['results']['trial_output_file']
         trial_output_dir = data['results']['trial_output_dir']
     
         cohesion_min, cohesion_max = soil_cfg['cohesion_range']
@@ -161,49 +239,50 @@ def objective_closure(data):
         data["downlink"].setdefault("sim_input_dir", "") 
         data["downlink"].setdefault("control_input_dir", "")
         
+        print(json.dumps(data))
+        print(f"Starting for params ... bd={bulk_density} c={cohesion} f={friction} ym={youngs_modulus}")
         for i in range(n_trials):
-            data["downlink"]["sim_input_dir"] = data['trials'][i]['sim_input_dirs'] 
-            data["downlink"]["control_input_dir"] = data['trials'][i]['control_input_dirs']
-            data["incon"] = data['trials'][i]['incons']
-            
-            print(data['incon'])
-            print(json.dumps(data))
-            
-            try:
-                print(f"Starting for params ... bd={bulk_density} c={cohesion} f={friction} ym={youngs_modulus}")
-                with open(sim_output_dir,"w"):
-                    pass; # Clear file before starting for visualization
-                
-                cmd = ["demo_cmars",json.dumps(data)]
-                if(data['render']):
-                    cmd.append("-r")
-                
-                stdout=subprocess.DEVNULL
-                if(data['verbose']):
-                    stdout=None    
-                    
-                result = subprocess.Popen(
-                    cmd,  
-                    # cwd="../cmars/build/demos/",
-                    stdout=stdout 
-                )
-                score = None
-                while (result.poll() is None):
-                    time.sleep(1)
-            
-                if result.returncode != 0:
-                    print(f"[Trial {trial.number}] Subprocess failed (exit code {result.returncode}).")
-                    raise optuna.TrialPruned()
-                
-            except Exception as e:
-                result.kill()
-                time.sleep(10)
-                print(f"Failed {e}")
-                shutil.copy(sim_output_dir, f"{trial_output_dir}/pruned_output_{id}_{trial.number}_{i}.csv")
-                raise e
-        
-            score_result[i] = compute_score(data)
-            shutil.copy(sim_output_dir, f"{trial_output_dir}/successful_output_{id}_{trial.number}_{i}.csv") 
+            with open(trial_output_file(data, i),"w"):
+                pass; # Clear file before starting for visualization
+
+        # Running position SSE, cumulated over the trial list, reported per second of drive so the
+        # pruner can kill a bad candidate mid-drive instead of after t_fin
+        partial = [ 0.0 ] * n_trials
+        def on_progress(i, progress):
+            if progress['residual'] is None:
+                return
+            partial[i] = progress['residual']
+            step = int(sum(data['trials'][j]['incons']['t_fin'] for j in range(i)) + progress['t'])
+            trial.report(sum(partial), step)
+            if trial.should_prune():
+                print(f"[Trial {trial.number}] Pruned at {step} s of drive (residual {sum(partial)}).")
+                try:
+                    os.kill(progress['pid'], signal.SIGKILL)
+                except ProcessLookupError:
+                    pass
+
+        # Every entry of data['trials'] runs in one demo_cmars call, sharing its setup
+        if worker is not None:
+            records = worker.run(data, n_trials, on_progress)
+        else:
+            records = run_trials(data, n_trials, on_progress)
+
+        for i, record in enumerate(records):
+            output_file = trial_output_file(data, i)
+            if 'diverged' in record:
+                # Stopped early by a divergence guard of the simdef's "guards" section, record has the partial score
+                print(f"[Trial {trial.number}] Simulation {i} diverged at {record['t_end']}: {record['diverged']}.")
+                trial.set_user_attr("diverged", record['diverged'])
+                shutil.copy(output_file, f"{trial_output_dir}/diverged_output_{id}_{trial.number}_{i}.csv")
+                raise optuna.TrialPruned()
+            if record['status'] != 0:
+                print(f"[Trial {trial.number}] Simulation {i} failed ({record}).")
+                shutil.copy(output_file, f"{trial_output_dir}/pruned_output_{id}_{trial.number}_{i}.csv")
+                raise optuna.TrialPruned()
+
+            # demo_cmars scores the drive itself, compute_score is the fallback for records without one
+            score_result[i] = record['score'] if 'score' in record else compute_score(trial_data(data, i))
+            shutil.copy(output_file, f"{trial_output_dir}/successful_output_{id}_{trial.number}_{i}.csv") 
             
         print(score_result)
         
@@ -318,8 +397,22 @@ def main():
         )
         
         benchmark = False 
+
+        # Stream running residuals every report_interval [s] of drive, and skip the rest of a trial list once an entry is pruned
+        data['results']['progress_interval'] = data['optimizer'].get('report_interval', 5.0)
+        data['stop_on_failure'] = True
+        data['results']['score'] = True
         
-        objective = objective_closure(data)
-        
-        study.optimize(objective, n_trials=100)
+        # One long-lived demo_cmars for the whole study instead of a process per simulation
+        worker = None
+        if data['optimizer'].get('worker', False):
+            worker = SimWorker(render=data['render'], verbose=data['verbose'])
+
+        objective = objective_closure(data, worker)
+
+        try:
+            study.optimize(objective, n_trials=100)
+        finally:
+            if worker is not None:
+                worker.close()
 